@@ -0,0 +1,188 @@
+#ifndef DELEGATE_H_
+#define DELEGATE_H_
+#include "tpm.h"
+#include "ui.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <openssl/evp.h>
+#include <string>
+#include <vector>
+
+/**
+ * Shortest accepted delegation lifetime in seconds. A TPM2_Sign can take a
+ * good part of a second, so a shorter window may close before the freshly
+ * certified key is used.
+ */
+constexpr uint64_t kMinDelegationTtlSecs = 5;
+
+/**
+ * Manifest lines read and signed in parallel per batch in delegated manifest
+ * mode.
+ */
+constexpr size_t kDelegateBatch = 4096;
+
+/**
+ * Limits after which a delegated software key is retired and a new one is
+ * certified by the TPM.
+ */
+struct DelegationBudget {
+  uint64_t maxSignatures = 100000;    ///< Signatures allowed per key
+  std::chrono::seconds lifetime{300}; ///< Validity window per key
+};
+
+/**
+ * In-memory OpenSSL key.
+ *
+ * This structure owns the EVP_PKEY and ensures it is freed upon destruction.
+ */
+struct SoftKey {
+  EVP_PKEY *pkey = nullptr; ///< Pointer to the OpenSSL key
+  SoftKey() = default;
+  SoftKey(const SoftKey &) = delete;
+  SoftKey &operator=(const SoftKey &) = delete;
+  ~SoftKey() {
+    if (pkey)
+      EVP_PKEY_free(pkey);
+  }
+};
+
+/**
+ * A short-lived software signing key and the TPM-signed statement that
+ * delegates signing authority to it.
+ *
+ * The statement is a fixed binary encoding (all integers big-endian):
+ *
+ *   "TPMSIGN-DELEGATION-1" | serial (u64) | notBefore (u64) | notAfter (u64)
+ *   | maxSignatures (u64) | SPKI length (u32) | SPKI (DER)
+ *
+ * The TPM child key signs SHA-256(statement) with RSASSA or ECDSA, so any
+ * verifier holding the child public key can check it with a plain SHA-256
+ * signature verify.
+ */
+struct Delegation {
+  SoftKey key;                             ///< The delegated software key
+  std::vector<unsigned char> statement;    ///< Encoded delegation statement
+  std::vector<unsigned char> tpmSignature; ///< TPM signature over statement
+  uint64_t serial = 0;                     ///< Rotation counter
+  uint64_t notAfter = 0;                   ///< Expiry (Unix seconds)
+  uint64_t maxSignatures = 0;              ///< Signature budget
+  std::atomic<uint64_t> used{0};           ///< Signatures issued so far
+};
+
+/**
+ * Rotating signer backed by TPM-certified software keys.
+ *
+ * Signing only touches the TPM when the current delegation is exhausted or
+ * expired, so DelegatedSign may be called from any number of threads. The
+ * ESYS context is only used while holding @c mu.
+ */
+struct DelegatedSigner {
+  EsysCtx *esys = nullptr;               ///< ESAPI context used to rotate
+  ESYS_TR childHandle = ESYS_TR_NONE;    ///< TPM key certifying delegations
+  ESYS_TR sessionHandle = ESYS_TR_NONE;  ///< Session authorizing Sign
+  TPM2_ALG_ID keyAlg = TPM2_ALG_RSA;     ///< Algorithm of the child key
+  DelegationBudget budget;               ///< Rotation budget
+  std::mutex mu;                         ///< Serializes rotation
+  std::atomic<std::shared_ptr<Delegation>> current; ///< Active delegation
+};
+
+/**
+ * Generates a fresh software key and has the TPM child key sign a delegation
+ * statement over its public key.
+ *
+ * @param esys           EsysCtx structure providing the ESAPI context used
+ *                       to talk to the TPM.
+ * @param childHandle    The handle of the loaded child signing key.
+ * @param sessionHandle  Authorization session handle used to authorize Sign.
+ * @param keyAlg         Algorithm of the child key (RSA or ECC).
+ * @param budget         Lifetime and signature budget for the new key.
+ * @param serial         Serial number recorded in the statement.
+ * @param delegation     Output parameter that receives the new delegation.
+ *
+ * @return true if the delegation is created successfully; false otherwise.
+ */
+bool CreateDelegation(EsysCtx &esys, ESYS_TR childHandle,
+                      ESYS_TR sessionHandle, TPM2_ALG_ID keyAlg,
+                      const DelegationBudget &budget, uint64_t serial,
+                      Delegation &delegation);
+
+/**
+ * Signs a message with the signer's current delegated key, rotating it
+ * through the TPM first if its budget is spent.
+ *
+ * @param signer      The delegated signer.
+ * @param message     The message to sign (hashed with SHA-256).
+ * @param signature   Output parameter that receives the DER ECDSA signature.
+ * @param delegation  Output parameter that receives the delegation whose key
+ *                    produced @p signature.
+ *
+ * @return true if the message is signed successfully; false otherwise.
+ */
+bool DelegatedSign(DelegatedSigner &signer, const std::string &message,
+                   std::vector<unsigned char> &signature,
+                   std::shared_ptr<const Delegation> &delegation);
+
+/**
+ * Verifies a signature produced by a delegated key.
+ *
+ * Checks the TPM signature over the delegation statement with @p tpmKey,
+ * checks that @p now lies inside the statement's validity window, then
+ * checks the software signature over @p message. The signature budget is not
+ * checked since a stateless verifier cannot count signatures.
+ *
+ * @param tpmKey        Public area of the TPM child key (RSA or ECC P-256).
+ * @param statement     The encoded delegation statement.
+ * @param tpmSignature  TPM signature over @p statement.
+ * @param message       The signed message.
+ * @param signature     The software signature over @p message.
+ * @param now           Current time in Unix seconds.
+ *
+ * @return true if both signatures verify and the delegation is valid.
+ */
+bool VerifyDelegated(const TPM2B_PUBLIC &tpmKey,
+                     const std::vector<unsigned char> &statement,
+                     const std::vector<unsigned char> &tpmSignature,
+                     const std::string &message,
+                     const std::vector<unsigned char> &signature,
+                     uint64_t now);
+
+/**
+ * Signs the message given by the user with a TPM-certified software key and
+ * verifies the result against the child key's public area.
+ *
+ * @param args           Command line arguments describing the delegation
+ *                       budget and the message.
+ * @param esys           EsysCtx structure providing the ESAPI context used
+ *                       to talk to the TPM.
+ * @param childHandle    The handle of the loaded child signing key.
+ * @param sessionHandle  Authorization session handle used to authorize Sign.
+ *
+ * @return true if the message is signed and verified successfully.
+ */
+bool TPMDelegateSignMessage(Args &args, EsysCtx &esys, ESYS_TR &childHandle,
+                            ESYS_TR &sessionHandle);
+
+/**
+ * Signs every line of the manifest with TPM-certified software keys, using
+ * one thread per core.
+ *
+ * The output file starts with the child public key (PEM), followed by one
+ * `delegation <serial> <statement> <tpm signature>` line per key, each before
+ * the first item it signed, and one `<index> <serial> <signature>` line per
+ * manifest item, in manifest order. All binary fields are hex.
+ *
+ * @param args           Command line arguments describing the delegation
+ *                       budget, the manifest and the output path.
+ * @param esys           EsysCtx structure providing the ESAPI context used
+ *                       to talk to the TPM.
+ * @param childHandle    The handle of the loaded child signing key.
+ * @param sessionHandle  Authorization session handle used to authorize Sign.
+ *
+ * @return true if every item is signed and written; false otherwise.
+ */
+bool TPMDelegateSignManifest(Args &args, EsysCtx &esys, ESYS_TR &childHandle,
+                             ESYS_TR &sessionHandle);
+#endif // DELEGATE_H_
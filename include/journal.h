@@ -0,0 +1,108 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+#include "tpm.h"
+#include "ui.h"
+#include <cstdint>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Number of appended records between fsync checkpoints.
+ */
+constexpr uint64_t kJournalSyncInterval = 64;
+
+/**
+ * A single completed signing operation.
+ *
+ * On disk each record is one line:
+ *
+ *   <index> <digest hex> <signature hex> <check>
+ *
+ * where <check> is the first 8 hex characters of SHA-256 over the preceding
+ * fields (including the separating spaces). A torn or corrupted tail fails the
+ * check and is truncated on recovery.
+ */
+struct JournalRecord {
+  uint64_t index = 0;                   ///< Zero-based manifest line number
+  TPM2B_DIGEST digest{};                ///< SHA-256 of the manifest line
+  std::vector<unsigned char> signature; ///< TPM signature bytes
+};
+
+/**
+ * Append-only signing journal.
+ *
+ * This structure owns the journal file descriptor and ensures pending
+ * records are flushed to disk and the file is closed upon destruction, so an
+ * aborted run keeps everything it signed.
+ */
+struct Journal {
+  int fd = -1;                ///< Journal file descriptor
+  uint64_t nextIndex = 0;     ///< Index of the first unsigned item
+  uint64_t unsynced = 0;      ///< Records appended since the last fsync
+  bool hasLast = false;       ///< Whether @c last holds a recovered record
+  JournalRecord last;         ///< Last valid record found on recovery
+  ~Journal() {
+    if (fd >= 0) {
+      if (unsynced)
+        fsync(fd);
+      close(fd);
+    }
+  }
+};
+
+/**
+ * Opens (or creates) a journal and recovers its progress.
+ *
+ * The header line records the TPM name of the signing key; a journal written
+ * with another key is rejected. Records are validated in order; the first
+ * malformed, out-of-sequence or checksum-failing line ends recovery and the
+ * file is truncated there.
+ *
+ * @param path     Path of the journal file.
+ * @param keyName  Hex-encoded TPM name of the signing key.
+ * @param journal  The Journal structure to initialize.
+ * @return True if the journal is ready for appending, false otherwise.
+ */
+bool OpenJournal(const std::string &path, const std::string &keyName,
+                 Journal &journal);
+
+/**
+ * Appends a record to the journal, fsyncing every kJournalSyncInterval
+ * records.
+ *
+ * @param journal  The open journal.
+ * @param record   The record to append; its index must equal
+ *                 journal.nextIndex.
+ * @return True if the record is written, false otherwise.
+ */
+bool AppendJournal(Journal &journal, const JournalRecord &record);
+
+/**
+ * Flushes appended records to disk.
+ *
+ * @param journal  The open journal.
+ * @return True if the journal is synced, false otherwise.
+ */
+bool SyncJournal(Journal &journal);
+
+/**
+ * Signs every line of the manifest given in command line arguments,
+ * journaling each signature so an interrupted run can resume.
+ *
+ * Items already present in the journal are skipped without being hashed,
+ * except the last journaled item, which is re-hashed to check that the
+ * manifest has not changed since the journal was written.
+ *
+ * @param args           Command line arguments holding the manifest and
+ *                       journal paths.
+ * @param esys           EsysCtx structure providing the ESAPI context used
+ *                       to talk to the TPM.
+ * @param childHandle    The handle of the loaded child signing key.
+ * @param sessionHandle  Authorization session handle used to authorize Sign.
+ *
+ * @return true if every item is signed and journaled; false otherwise.
+ */
+bool TPMSignManifest(Args &args, EsysCtx &esys, ESYS_TR &childHandle,
+                     ESYS_TR &sessionHandle);
+#endif // JOURNAL_H_
@@ -0,0 +1,89 @@
+#ifndef PROBE_H_
+#define PROBE_H_
+#include "tpm.h"
+#include "ui.h"
+#include <cstdint>
+#include <string>
+
+/**
+ * Number of timed TPM2_Sign calls per candidate profile when probing.
+ */
+constexpr int kProbeSigns = 8;
+
+/**
+ * Signing profile chosen for this TPM, together with the resource limits it
+ * reported.
+ *
+ * The TPM identity and the benchmark result are cached on disk (see
+ * SaveProfile), so a later run on the same TPM skips the probe. The limits
+ * are read again on every run: the free slot counts are TPM2_PT_VAR
+ * properties that change with whatever is loaded at the moment.
+ */
+struct TPMProfile {
+  uint32_t manufacturer = 0;         ///< TPM2_PT_MANUFACTURER
+  uint32_t firmware1 = 0;            ///< TPM2_PT_FIRMWARE_VERSION_1
+  uint32_t firmware2 = 0;            ///< TPM2_PT_FIRMWARE_VERSION_2
+  TPM2_ALG_ID keyAlg = TPM2_ALG_RSA; ///< Fastest supported child key type
+  double signsPerSec = 0;            ///< Measured rate for keyAlg
+  uint32_t transientAvail = 0;       ///< TPM2_PT_HR_TRANSIENT_AVAIL
+  uint32_t loadedAvail = 0;          ///< TPM2_PT_HR_LOADED_AVAIL
+  uint32_t activeSessionsMax = 0;    ///< TPM2_PT_ACTIVE_SESSIONS_MAX
+  uint32_t maxDigest = 0;            ///< TPM2_PT_MAX_DIGEST
+  uint32_t maxCommandSize = 0;       ///< TPM2_PT_MAX_COMMAND_SIZE
+  uint32_t keySlots = 1;             ///< Child keys that fit beside primary
+  uint32_t concurrency = 1;          ///< Independent TPM signing contexts
+};
+
+/**
+ * Queries the TPM with TPM2_GetCapability and benchmarks each supported
+ * signing profile (RSA-2048/RSASSA and ECC P-256/ECDSA, both SHA-256).
+ *
+ * Each candidate child key is created, loaded, timed over kProbeSigns
+ * signatures and flushed again. Candidates are skipped when the TPM lacks
+ * the algorithm, curve or a free transient slot.
+ *
+ * @param esys           EsysCtx structure providing the ESAPI context used
+ *                       to talk to the TPM.
+ * @param primaryHandle  Handle of the loaded primary key.
+ * @param sessionHandle  Authorization session handle.
+ * @param profile        Output parameter that receives the probe result.
+ * @return True if at least one profile is usable, false otherwise.
+ */
+bool TPMProbe(EsysCtx &esys, ESYS_TR primaryHandle, ESYS_TR sessionHandle,
+              TPMProfile &profile);
+
+/**
+ * Writes the cacheable part of a profile (TPM identity, key type and
+ * measured rate) to @p path as key=value lines.
+ *
+ * @return True if the profile is saved, false otherwise.
+ */
+bool SaveProfile(const std::string &path, const TPMProfile &profile);
+
+/**
+ * Reads a profile written by SaveProfile. The limits are left untouched.
+ *
+ * @return True if the file exists and parses, false otherwise.
+ */
+bool LoadProfile(const std::string &path, TPMProfile &profile);
+
+/**
+ * Selects the signing profile for this run.
+ *
+ * Uses the cached profile from @p args when it matches the connected TPM's
+ * manufacturer and firmware version and @c args.probe is not set; otherwise
+ * runs TPMProbe and updates the cache. The limits, key slots and concurrency
+ * always come from the TPM's current properties. On success @c args.keyAlg
+ * is set to the selected key type.
+ *
+ * @param args           The command line arguments.
+ * @param esys           EsysCtx structure providing the ESAPI context used
+ *                       to talk to the TPM.
+ * @param primaryHandle  Handle of the loaded primary key.
+ * @param sessionHandle  Authorization session handle.
+ * @param profile        Output parameter that receives the selected profile.
+ * @return True if a profile is selected, false otherwise.
+ */
+bool TPMSelectProfile(Args &args, EsysCtx &esys, ESYS_TR primaryHandle,
+                      ESYS_TR sessionHandle, TPMProfile &profile);
+#endif // PROBE_H_
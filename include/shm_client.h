@@ -0,0 +1,201 @@
+#ifndef SHM_CLIENT_H_
+#define SHM_CLIENT_H_
+#include "shm_ring.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+/**
+ * Header-only client for `tpm-sign --serve-shm`.
+ *
+ * Usage:
+ *
+ *   ShmSignClient client;
+ *   if (ShmSignConnect("/tpm-sign", client) &&
+ *       ShmSign(client, digest, 32, signature))
+ *     ...
+ *
+ * A client may be shared by several threads; each ShmSign call claims its
+ * own slot.
+ */
+
+/**
+ * Spin iterations before a client falls back to sleeping on its futex.
+ */
+constexpr int kShmClientSpin = 256;
+
+/**
+ * Longest a client waits for a free slot or for its signature, in
+ * milliseconds. Generous enough for a full ring of TPM signatures.
+ */
+constexpr uint64_t kShmClientTimeoutMs = 10000;
+
+/**
+ * Mapping of the server's ring.
+ *
+ * This structure owns the mapping and ensures it is released upon
+ * destruction.
+ */
+struct ShmSignClient {
+  ShmRingHeader *ring = nullptr; ///< Mapped ring
+  ShmSignClient() = default;
+  ShmSignClient(const ShmSignClient &) = delete;
+  ShmSignClient &operator=(const ShmSignClient &) = delete;
+  ~ShmSignClient() {
+    if (ring)
+      munmap(ring, sizeof(ShmRingHeader));
+  }
+};
+
+/**
+ * Maps the ring published by the server under @p name.
+ *
+ * @param name    POSIX shared-memory name, e.g. "/tpm-sign".
+ * @param client  The ShmSignClient structure to initialize.
+ * @return True if the ring is mapped and ready, false otherwise.
+ */
+inline bool ShmSignConnect(const char *name, ShmSignClient &client) {
+  int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+  if (fd < 0)
+    return false;
+  // The server sizes the object after creating it; touching a mapping past
+  // the end of a short object raises SIGBUS.
+  struct stat st{};
+  if (fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(ShmRingHeader)) {
+    close(fd);
+    return false;
+  }
+  void *addr = mmap(nullptr, sizeof(ShmRingHeader), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+
+  client.ring = static_cast<ShmRingHeader *>(addr);
+  if (client.ring->magic.load(std::memory_order_acquire) != kShmRingMagic ||
+      client.ring->version != kShmRingVersion ||
+      client.ring->slots != kShmRingSlots) {
+    munmap(addr, sizeof(ShmRingHeader));
+    client.ring = nullptr;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Returns true if the server process that owns the ring still exists and is
+ * not shutting down.
+ */
+inline bool ShmServerAlive(const ShmSignClient &client) {
+  return !client.ring->closed.load(std::memory_order_acquire) &&
+         ShmProcessAlive(client.ring->serverPid);
+}
+
+/**
+ * Hands a slot held at position @p pos (seq == pos + 1) to the next lap.
+ *
+ * @return False if the server already reclaimed the slot.
+ */
+inline bool ShmReleaseSlot(ShmSlot &slot, uint64_t pos) {
+  uint64_t held = pos + 1;
+  return slot.seq.compare_exchange_strong(held, pos + kShmRingSlots,
+                                          std::memory_order_release);
+}
+
+/**
+ * Submits a digest and blocks until the server writes the signature back.
+ *
+ * @param client      A connected client.
+ * @param digest      SHA-256 digest to sign.
+ * @param digestSize  Length of @p digest (must be 32).
+ * @param signature   Output parameter that receives the signature bytes
+ *                    (RSASSA raw, or DER for ECDSA).
+ * @param sigAlg      Optional output parameter that receives the
+ *                    TPM2_ALG_ID of the signature.
+ * @return True if the server signed the digest, false if it failed, shut
+ *         down, died, or did not answer within kShmClientTimeoutMs.
+ */
+inline bool ShmSign(ShmSignClient &client, const unsigned char *digest,
+                    size_t digestSize, std::vector<unsigned char> &signature,
+                    uint16_t *sigAlg = nullptr) {
+  ShmRingHeader &ring = *client.ring;
+  if (digestSize > kShmMaxDigest)
+    return false;
+
+  if (!ShmServerAlive(client))
+    return false;
+  const uint64_t deadline = ShmNowMs() + kShmClientTimeoutMs;
+
+  // Claim a position whose slot is free on this lap.
+  uint64_t pos = ring.tail.load(std::memory_order_relaxed);
+  ShmSlot *slot;
+  for (;;) {
+    slot = &ring.slot[pos & (kShmRingSlots - 1)];
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    int64_t diff = static_cast<int64_t>(seq - pos);
+    if (diff == 0) {
+      if (ring.tail.compare_exchange_weak(pos, pos + 1,
+                                          std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // Ring full: the slot is still owned by the previous lap.
+      if (!ShmServerAlive(client) || ShmNowMs() >= deadline)
+        return false;
+      sched_yield();
+      pos = ring.tail.load(std::memory_order_relaxed);
+    } else {
+      pos = ring.tail.load(std::memory_order_relaxed);
+    }
+  }
+  slot->owner.store(ShmOwnerTag(pos, getpid()), std::memory_order_relaxed);
+
+  std::memcpy(slot->digest, digest, digestSize);
+  slot->digestSize = static_cast<uint16_t>(digestSize);
+  slot->state.store(kShmSlotPending, std::memory_order_relaxed);
+  slot->waiting.store(0, std::memory_order_relaxed);
+  uint64_t claimed = pos;
+  if (!slot->seq.compare_exchange_strong(claimed, pos + 1,
+                                         std::memory_order_release)) {
+    // The server gave up on us while we were writing the request.
+    ShmReleaseSlot(*slot, pos);
+    return false;
+  }
+
+  ring.doorbell.fetch_add(1, std::memory_order_seq_cst);
+  if (ring.serverSleeping.load(std::memory_order_seq_cst))
+    ShmFutexWake(ring.doorbell, 1);
+
+  const timespec timeout{0, 100 * 1000 * 1000};
+  for (int spin = 0;
+       slot->state.load(std::memory_order_acquire) != kShmSlotDone; spin++) {
+    if (spin < kShmClientSpin)
+      continue;
+    // On timeout the slot is left to the server, which reclaims it.
+    if (!ShmServerAlive(client) || ShmNowMs() >= deadline)
+      return false;
+    slot->waiting.store(1, std::memory_order_seq_cst);
+    if (slot->state.load(std::memory_order_seq_cst) != kShmSlotDone)
+      ShmFutexWait(slot->state, kShmSlotPending, &timeout);
+  }
+
+  bool signedOk = slot->status == kShmStatusOk;
+  if (signedOk)
+    signature.assign(slot->signature, slot->signature + slot->signatureSize);
+  if (sigAlg)
+    *sigAlg = slot->sigAlg;
+
+  // Hand the slot to the next lap. If the server reclaimed it first, what we
+  // read may already belong to another request.
+  if (!ShmReleaseSlot(*slot, pos)) {
+    signature.clear();
+    return false;
+  }
+  return signedOk;
+}
+#endif // SHM_CLIENT_H_
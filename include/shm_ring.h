@@ -0,0 +1,170 @@
+#ifndef SHM_RING_H_
+#define SHM_RING_H_
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * Shared-memory submission ring between local clients and `tpm-sign
+ * --serve-shm`.
+ *
+ * This header only describes the memory layout and the futex helpers, so it
+ * can be used by clients that do not link against tpm2-tss (see
+ * shm_client.h).
+ *
+ * The ring is a bounded multi-producer / single-consumer queue where every
+ * slot carries a sequence number. For the request at position `pos`
+ * (slot `pos % kShmRingSlots`):
+ *
+ * - seq == pos:                     slot free, a client may claim it
+ * - seq == pos + 1:                 request published, server may sign it
+ * - state == kShmSlotDone:          signature written back in place
+ * - seq == pos + kShmRingSlots:     client has read the result and released
+ *                                   the slot for the next lap
+ *
+ * Clients claim positions with a CAS on @c tail. The server walks @c head in
+ * order. Wakeups use futexes: the server sleeps on @c doorbell and each client
+ * sleeps on its slot's @c state. Each side announces that it is about to sleep
+ * (@c serverSleeping, @c waiting), so no wake syscall is made while the other
+ * side is still running.
+ *
+ * A claimed slot records its client's pid in @c owner, tagged with the
+ * position it was claimed for (see ShmOwnerTag). If the head slot stays
+ * claimed but unpublished, or served but unreleased, and its owner has died or
+ * the stall outlasts a timeout, the server takes it back:
+ *
+ * - seq == pos (claimed):  the server moves seq to pos + 1 itself and skips
+ *                          the request. The client publishes and releases with
+ *                          a CAS, so it notices and gives up.
+ * - seq == pos + 1 (done): on the next lap the server releases the slot.
+ *
+ * On shutdown the server sets @c closed and clears @c magic. It then fails
+ * every published request with kShmStatusShutdown.
+ */
+
+constexpr uint32_t kShmRingMagic = 0x54505352; ///< "TPSR"
+constexpr uint32_t kShmRingVersion = 3;
+constexpr uint32_t kShmRingSlots = 64; ///< Must be a power of two
+constexpr size_t kShmMaxDigest = 64;
+constexpr size_t kShmMaxSignature = 512;
+
+static_assert((kShmRingSlots & (kShmRingSlots - 1)) == 0,
+              "kShmRingSlots must be a power of two");
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+                  sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "futex words must be plain 32-bit integers");
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "ring counters must be lock-free to be process-shared");
+
+/**
+ * Values of ShmSlot::state.
+ */
+enum ShmSlotState : uint32_t {
+  kShmSlotPending = 0, ///< Waiting for the server
+  kShmSlotDone = 1,    ///< Result written back
+};
+
+/**
+ * Values of ShmSlot::status.
+ */
+enum ShmStatus : uint32_t {
+  kShmStatusOk = 0,         ///< Signature is valid
+  kShmStatusBadRequest = 1, ///< Digest has the wrong size
+  kShmStatusTPMError = 2,   ///< TPM2_Sign failed
+  kShmStatusShutdown = 3,   ///< Server stopped before signing
+};
+
+/**
+ * One request/response slot. Cache-line aligned so neighbouring clients do
+ * not false-share.
+ */
+struct alignas(64) ShmSlot {
+  std::atomic<uint64_t> seq{0};     ///< Sequence number (see above)
+  std::atomic<uint32_t> state{0};   ///< ShmSlotState; futex word for client
+  std::atomic<uint32_t> waiting{0}; ///< Client is in futex wait
+  std::atomic<uint64_t> owner{0};   ///< ShmOwnerTag of the claiming client
+  uint32_t status = 0;              ///< ShmStatus of the response
+  uint16_t digestSize = 0;          ///< Request digest length
+  uint16_t sigAlg = 0;              ///< TPM2_ALG_ID of the signature
+  uint16_t signatureSize = 0;       ///< Response signature length
+  unsigned char digest[kShmMaxDigest];       ///< SHA-256 digest to sign
+  unsigned char signature[kShmMaxSignature]; ///< RSASSA raw or ECDSA DER
+};
+
+/**
+ * The whole shared-memory object.
+ */
+struct ShmRingHeader {
+  std::atomic<uint32_t> magic{0};                ///< Set once server is ready
+  uint32_t version = 0;                          ///< kShmRingVersion
+  uint32_t slots = 0;                            ///< kShmRingSlots
+  int32_t serverPid = 0;                         ///< Detects a dead server
+  std::atomic<uint32_t> closed{0};               ///< Server is shutting down
+  alignas(64) std::atomic<uint64_t> tail{0};     ///< Next client position
+  alignas(64) std::atomic<uint64_t> head{0};     ///< Next server position
+  alignas(64) std::atomic<uint32_t> doorbell{0}; ///< Server futex word
+  std::atomic<uint32_t> serverSleeping{0};       ///< Server in futex wait
+  ShmSlot slot[kShmRingSlots];                   ///< Request slots
+};
+
+/**
+ * Returns true if the process @p pid still exists.
+ */
+inline bool ShmProcessAlive(int32_t pid) {
+  return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+/**
+ * Packs a claim for ShmSlot::owner: the low 32 bits of the claimed position
+ * above the client's pid. The tag keeps an owner left over from an earlier
+ * lap, or from another thread of the same process, from being mistaken for
+ * the current one, so nobody has to clear it.
+ */
+inline uint64_t ShmOwnerTag(uint64_t pos, int32_t pid) {
+  return (pos << 32) | static_cast<uint32_t>(pid);
+}
+
+/**
+ * Returns the pid in @p owner if it was recorded for position @p pos, or 0.
+ */
+inline int32_t ShmOwnerPid(uint64_t owner, uint64_t pos) {
+  return (owner >> 32) == (pos & 0xffffffffu) ? static_cast<int32_t>(owner)
+                                               : 0;
+}
+
+/**
+ * Returns CLOCK_MONOTONIC in milliseconds, for stall and wait timeouts.
+ */
+inline uint64_t ShmNowMs() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Waits on a process-shared futex while @p word equals @p expected.
+ *
+ * @param word      The futex word.
+ * @param expected  Value the word must still hold for the wait to block.
+ * @param timeout   Relative timeout, or nullptr to wait indefinitely.
+ */
+inline void ShmFutexWait(std::atomic<uint32_t> &word, uint32_t expected,
+                         const timespec *timeout) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected,
+          timeout, nullptr, 0);
+}
+
+/**
+ * Wakes up to @p count waiters on a process-shared futex.
+ */
+inline void ShmFutexWake(std::atomic<uint32_t> &word, int count) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, count,
+          nullptr, nullptr, 0);
+}
+#endif // SHM_RING_H_
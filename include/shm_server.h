@@ -0,0 +1,78 @@
+#ifndef SHM_SERVER_H_
+#define SHM_SERVER_H_
+#include "shm_ring.h"
+#include "tpm.h"
+#include "ui.h"
+#include <string>
+#include <sys/mman.h>
+
+/**
+ * Spin iterations before an idle server sleeps on the doorbell futex.
+ */
+constexpr int kShmServerSpin = 4096;
+
+/**
+ * How long the head slot may stay claimed but unpublished, or served but
+ * unreleased, by a live client before the server takes it back, in
+ * milliseconds. Slots of dead clients are taken back at once.
+ */
+constexpr uint64_t kShmStallTimeoutMs = 1000;
+
+/**
+ * Server-side shared-memory ring.
+ *
+ * This structure owns the mapping, the POSIX shared-memory name and the
+ * server lock, and ensures all are released upon destruction so clients see
+ * the ring disappear.
+ */
+struct ShmRing {
+  std::string name;              ///< POSIX shared-memory name
+  ShmRingHeader *ring = nullptr; ///< Mapped ring
+  int lockFd = -1;               ///< flock held on NAME.lock while serving
+  ShmRing() = default;
+  ShmRing(const ShmRing &) = delete;
+  ShmRing &operator=(const ShmRing &) = delete;
+  ~ShmRing() {
+    if (ring) {
+      munmap(ring, sizeof(ShmRingHeader));
+      shm_unlink(name.c_str());
+      ok("Shared-memory ring removed");
+    }
+    // Unlock last, so the next server cannot start until the name is gone.
+    if (lockFd >= 0)
+      close(lockFd);
+  }
+};
+
+/**
+ * Creates the shared-memory ring named @p name. A ring left behind by a dead
+ * server is replaced; a ring whose server is still running is not.
+ *
+ * Ownership is an exclusive flock on the shared-memory object "NAME.lock",
+ * which is created on first use and left in place.
+ *
+ * @param name  POSIX shared-memory name, e.g. "/tpm-sign".
+ * @param shm   The ShmRing structure to initialize.
+ * @return True if the ring is created and published, false otherwise.
+ */
+bool CreateShmRing(const std::string &name, ShmRing &shm);
+
+/**
+ * Serves signing requests from the shared-memory ring named in the command
+ * line arguments until SIGINT or SIGTERM.
+ *
+ * The ESYS context and the loaded child key stay owned by this process;
+ * clients (see shm_client.h) only place digests in the ring and read
+ * signatures back in place.
+ *
+ * @param args           Command line arguments holding the ring name.
+ * @param esys           EsysCtx structure providing the ESAPI context used
+ *                       to talk to the TPM.
+ * @param childHandle    The handle of the loaded child signing key.
+ * @param sessionHandle  Authorization session handle used to authorize Sign.
+ *
+ * @return true if the server shut down cleanly; false otherwise.
+ */
+bool TPMServeShm(Args &args, EsysCtx &esys, ESYS_TR &childHandle,
+                 ESYS_TR &sessionHandle);
+#endif // SHM_SERVER_H_
@@ -7,6 +7,7 @@
 #include <tss2/tss2_esys.h>
 #include <tss2/tss2_rc.h>
 #include <tss2/tss2_tctildr.h>
+#include <vector>
 
 /**
  * The TCTI or "Transmission Interface" is the communication mechanism with the
@@ -153,6 +154,69 @@ static TPM2B_PUBLIC MakeRSASigningChildTemplate() {
   return c;
 }
 
+/**
+ * Makes ECC Signing Child Template
+ *
+ * This function creates a template for an ECC signing child key. It matches
+ * MakeRSASigningChildTemplate except that the key is a NIST P-256 key that
+ * signs with ECDSA over SHA-256.
+ *
+ * @return A TPM2B_PUBLIC structure representing the ECC signing child key
+ * template.
+ */
+static TPM2B_PUBLIC MakeECCSigningChildTemplate() {
+  TPM2B_PUBLIC c{};
+  c.publicArea.type = TPM2_ALG_ECC;
+  c.publicArea.nameAlg = TPM2_ALG_SHA256;
+
+  c.publicArea.objectAttributes =
+      TPMA_OBJECT_FIXEDTPM | TPMA_OBJECT_FIXEDPARENT |
+      TPMA_OBJECT_SENSITIVEDATAORIGIN | TPMA_OBJECT_USERWITHAUTH |
+      TPMA_OBJECT_SIGN_ENCRYPT;
+
+  c.publicArea.authPolicy.size = 0;
+
+  c.publicArea.parameters.eccDetail.symmetric.algorithm = TPM2_ALG_NULL;
+
+  c.publicArea.parameters.eccDetail.scheme.scheme = TPM2_ALG_ECDSA;
+  c.publicArea.parameters.eccDetail.scheme.details.ecdsa.hashAlg =
+      TPM2_ALG_SHA256;
+
+  c.publicArea.parameters.eccDetail.curveID = TPM2_ECC_NIST_P256;
+  c.publicArea.parameters.eccDetail.kdf.scheme = TPM2_ALG_NULL;
+
+  c.publicArea.unique.ecc.x.size = 0;
+  c.publicArea.unique.ecc.y.size = 0;
+  return c;
+}
+
+/**
+ * Makes the signing child template for a key algorithm.
+ *
+ * @param keyAlg TPM2_ALG_RSA or TPM2_ALG_ECC.
+ * @return The matching signing child key template.
+ */
+static TPM2B_PUBLIC MakeSigningChildTemplate(TPM2_ALG_ID keyAlg) {
+  return keyAlg == TPM2_ALG_ECC ? MakeECCSigningChildTemplate()
+                                : MakeRSASigningChildTemplate();
+}
+
+/**
+ * Makes the signing scheme used with a child key of the given algorithm:
+ * RSASSA/SHA-256 for RSA keys and ECDSA/SHA-256 for ECC keys.
+ */
+static TPMT_SIG_SCHEME MakeSigningScheme(TPM2_ALG_ID keyAlg) {
+  TPMT_SIG_SCHEME scheme{};
+  if (keyAlg == TPM2_ALG_ECC) {
+    scheme.scheme = TPM2_ALG_ECDSA;
+    scheme.details.ecdsa.hashAlg = TPM2_ALG_SHA256;
+  } else {
+    scheme.scheme = TPM2_ALG_RSASSA;
+    scheme.details.rsassa.hashAlg = TPM2_ALG_SHA256;
+  }
+  return scheme;
+}
+
 /**
  * Connects to the TPM using TCTI and ESYS contexts.
  *
@@ -195,6 +259,31 @@ bool TPMStartup(Args &args, EsysCtx &esys);
 bool TPMCreatePrimary(Args &args, EsysCtx &esys, ESYS_TR &primaryHandle,
                       ESYS_TR sessionHandle = ESYS_TR_PASSWORD);
 
+/**
+ * Saves a child key's public and (TPM-wrapped) private blobs to a file.
+ *
+ * The blobs are marshaled with tss2-mu and written atomically, so the key
+ * can be loaded again under the same primary in a later run.
+ *
+ * @param path  Destination file.
+ * @param pub   Public area returned by TPM2_Create.
+ * @param priv  Private blob returned by TPM2_Create.
+ * @return True if the blob is saved, false otherwise.
+ */
+bool SaveKeyBlob(const std::string &path, const TPM2B_PUBLIC &pub,
+                 const TPM2B_PRIVATE &priv);
+
+/**
+ * Loads a key blob written by SaveKeyBlob.
+ *
+ * @param path  Source file.
+ * @param pub   Output parameter that receives the public area.
+ * @param priv  Output parameter that receives the private blob.
+ * @return True if the blob is read and unmarshaled, false otherwise.
+ */
+bool LoadKeyBlob(const std::string &path, TPM2B_PUBLIC &pub,
+                 TPM2B_PRIVATE &priv);
+
 /**
  * Creates and loads a child signing key under the specified primary key.
  *
@@ -208,6 +297,13 @@ bool TPMCreatePrimary(Args &args, EsysCtx &esys, ESYS_TR &primaryHandle,
  * internally (for example, via MakeRSASigningChildTemplate or an equivalent
  * helper).
  *
+ * The key algorithm is taken from @p args (see TPMSelectProfile); when a key
+ * blob is loaded, @p args is updated to the algorithm of the loaded key.
+ *
+ * If @p args names a child key blob that already exists, the key is loaded
+ * from it instead of being created; if it names one that does not exist, the
+ * new key is saved there. This keeps the key stable across resumed runs.
+ *
  * Authorization for both TPM2_Create and TPM2_Load is provided through
  * @p sessionHandle, which can be a password session, an HMAC session, or any
  * other supported authorization session. The primary key must already exist
@@ -235,6 +331,37 @@ bool TPMCreatePrimary(Args &args, EsysCtx &esys, ESYS_TR &primaryHandle,
 bool TPMCreateLoad(Args &args, EsysCtx &esys, ESYS_TR &primaryHandle,
                    ESYS_TR sessionHandle, ESYS_TR &childHandle);
 
+/**
+ * Signs a precomputed SHA-256 digest with the loaded child key using the
+ * scheme from MakeSigningScheme.
+ *
+ * @param esys           EsysCtx structure providing the ESAPI context used
+ *                       to talk to the TPM.
+ * @param childHandle    The handle of the loaded child signing key.
+ * @param sessionHandle  Authorization session handle used to authorize Sign.
+ * @param keyAlg         Algorithm of the child key (RSA or ECC).
+ * @param digest         The digest to sign.
+ * @param signature      Output parameter that receives the signature. The
+ *                       caller must release it with Esys_Free.
+ *
+ * @return true if the digest is signed successfully; false otherwise.
+ */
+bool TPMSignDigest(EsysCtx &esys, ESYS_TR childHandle, ESYS_TR sessionHandle,
+                   TPM2_ALG_ID keyAlg, const TPM2B_DIGEST &digest,
+                   TPMT_SIGNATURE **signature);
+
+/**
+ * Extracts the raw signature bytes from a TPM signature.
+ *
+ * RSASSA signatures are returned as-is; ECDSA signatures are DER-encoded
+ * (ECDSA-Sig-Value) so they can be checked with OpenSSL directly.
+ *
+ * @param signature The signature returned by TPMSignDigest.
+ * @return The signature bytes, or an empty vector if the signature algorithm
+ *         is not supported.
+ */
+std::vector<unsigned char> TPMSignatureBytes(const TPMT_SIGNATURE &signature);
+
 /**
  * Signs the message given by the user in command line arguments.
  *
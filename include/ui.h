@@ -2,6 +2,7 @@
 #define UI_H
 
 #include "tss2_tpm2_types.h"
+#include <cstdint>
 #include <cstdio>
 #include <iostream>
 #include <sstream>
@@ -11,8 +12,19 @@
  * Command-line arguments for the CLI
  */
 struct Args {
-  bool autoMode = false; ///< Flag indicating if auto mode is active
-  std::string message;   ///< Message to be processed
+  bool autoMode = false;             ///< Flag indicating if auto mode is active
+  std::string message;               ///< Message to be processed
+  bool delegateMode = false;         ///< Sign with a TPM-certified soft key
+  uint64_t delegateMaxSigs = 100000; ///< Rotate soft key after N signatures
+  uint64_t delegateTtlSecs = 300;    ///< Rotate soft key after N seconds
+  std::string manifestPath;          ///< File whose lines are signed
+  std::string delegateOutPath;       ///< Output of a delegated manifest run
+  std::string journalPath;           ///< Journal for resumable signing
+  std::string childKeyPath;          ///< Child key blob reused across runs
+  bool probe = false;                ///< Re-probe the TPM, ignoring the cache
+  std::string profilePath;           ///< Cached signing profile
+  TPM2_ALG_ID keyAlg = TPM2_ALG_RSA; ///< Child key algorithm (RSA or ECC)
+  std::string shmName;               ///< Shared-memory ring to serve
 };
 
 // ANSI colors (works on most terminals; safe-ish fallback if unsupported)
@@ -68,6 +80,8 @@ inline std::string TPMAlgToString(TPM2_ALG_ID alg) {
     return "CFB";
   case TPM2_ALG_RSASSA:
     return "RSASSA";
+  case TPM2_ALG_ECDSA:
+    return "ECDSA";
   default:
     std::ostringstream oss;
     oss << "ALG(0x" << std::hex << alg << std::dec << ")";
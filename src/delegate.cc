@@ -0,0 +1,506 @@
+#include "delegate.h"
+#include "tpm.h"
+#include "ui.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/param_build.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <print>
+#include <thread>
+
+namespace {
+
+constexpr char kStatementMagic[] = "TPMSIGN-DELEGATION-1";
+constexpr size_t kStatementMagicLen = sizeof(kStatementMagic) - 1;
+
+/**
+ * Checks an OpenSSL return value and reports the queued error if it failed.
+ */
+bool CheckSSL(bool success, const char *what) {
+  if (!success) {
+    unsigned long err = ERR_get_error();
+    char buf[256];
+    ERR_error_string_n(err, buf, sizeof(buf));
+    fail(std::string(what) + ": " + (err ? buf : "unknown"));
+    ERR_clear_error();
+  }
+  return success;
+}
+
+std::string ToHex(const std::vector<unsigned char> &bytes) {
+  static const char digits[] = "0123456789abcdef";
+  std::string out(bytes.size() * 2, '0');
+  for (size_t i = 0; i < bytes.size(); i++) {
+    out[2 * i] = digits[bytes[i] >> 4];
+    out[2 * i + 1] = digits[bytes[i] & 0xf];
+  }
+  return out;
+}
+
+uint64_t NowUnix() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+void PutU64(std::vector<unsigned char> &out, uint64_t v) {
+  for (int shift = 56; shift >= 0; shift -= 8)
+    out.push_back(static_cast<unsigned char>(v >> shift));
+}
+
+void PutU32(std::vector<unsigned char> &out, uint32_t v) {
+  for (int shift = 24; shift >= 0; shift -= 8)
+    out.push_back(static_cast<unsigned char>(v >> shift));
+}
+
+uint64_t GetBE(const unsigned char *p, size_t n) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < n; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+/**
+ * Decoded view of a delegation statement.
+ */
+struct Statement {
+  uint64_t serial = 0;
+  uint64_t notBefore = 0;
+  uint64_t notAfter = 0;
+  uint64_t maxSignatures = 0;
+  const unsigned char *spki = nullptr;
+  size_t spkiLen = 0;
+};
+
+bool ParseStatement(const std::vector<unsigned char> &in, Statement &st) {
+  const size_t fixed = kStatementMagicLen + 4 * 8 + 4;
+  if (in.size() < fixed ||
+      std::memcmp(in.data(), kStatementMagic, kStatementMagicLen) != 0)
+    return false;
+
+  const unsigned char *p = in.data() + kStatementMagicLen;
+  st.serial = GetBE(p, 8);
+  st.notBefore = GetBE(p + 8, 8);
+  st.notAfter = GetBE(p + 16, 8);
+  st.maxSignatures = GetBE(p + 24, 8);
+  st.spkiLen = GetBE(p + 32, 4);
+  st.spki = p + 36;
+  return in.size() == fixed + st.spkiLen;
+}
+
+/**
+ * Builds an OpenSSL public key from the public area of a TPM RSA or ECC
+ * P-256 key.
+ */
+EVP_PKEY *TPMPublicToPKey(const TPM2B_PUBLIC &pub) {
+  const TPMT_PUBLIC &area = pub.publicArea;
+  bool isRSA = area.type == TPM2_ALG_RSA;
+  if (!isRSA && !(area.type == TPM2_ALG_ECC &&
+                  area.parameters.eccDetail.curveID == TPM2_ECC_NIST_P256)) {
+    fail("Delegation verify: unsupported TPM key type");
+    return nullptr;
+  }
+
+  BIGNUM *n = nullptr;
+  BIGNUM *e = nullptr;
+  std::vector<unsigned char> point;
+  OSSL_PARAM_BLD *bld = OSSL_PARAM_BLD_new();
+  OSSL_PARAM *params = nullptr;
+  EVP_PKEY_CTX *ctx =
+      EVP_PKEY_CTX_new_from_name(nullptr, isRSA ? "RSA" : "EC", nullptr);
+  EVP_PKEY *pkey = nullptr;
+
+  bool pushed = bld != nullptr;
+  if (pushed && isRSA) {
+    const TPM2B_PUBLIC_KEY_RSA &mod = area.unique.rsa;
+    uint32_t exp = area.parameters.rsaDetail.exponent;
+    n = BN_bin2bn(mod.buffer, mod.size, nullptr);
+    e = BN_new();
+    pushed = n && e && BN_set_word(e, exp ? exp : 65537) &&
+             OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_N, n) &&
+             OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_E, e);
+  } else if (pushed) {
+    // Uncompressed SEC1 point: 0x04 | X | Y
+    const TPMS_ECC_POINT &q = area.unique.ecc;
+    point.push_back(0x04);
+    point.insert(point.end(), q.x.buffer, q.x.buffer + q.x.size);
+    point.insert(point.end(), q.y.buffer, q.y.buffer + q.y.size);
+    pushed = OSSL_PARAM_BLD_push_utf8_string(
+                 bld, OSSL_PKEY_PARAM_GROUP_NAME, "P-256", 0) &&
+             OSSL_PARAM_BLD_push_octet_string(bld, OSSL_PKEY_PARAM_PUB_KEY,
+                                              point.data(), point.size());
+  }
+
+  bool built = pushed && ctx &&
+               (params = OSSL_PARAM_BLD_to_param(bld)) != nullptr &&
+               EVP_PKEY_fromdata_init(ctx) > 0 &&
+               EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_PUBLIC_KEY, params) > 0;
+  CheckSSL(built, "Import TPM public key");
+
+  EVP_PKEY_CTX_free(ctx);
+  OSSL_PARAM_free(params);
+  OSSL_PARAM_BLD_free(bld);
+  BN_free(e);
+  BN_free(n);
+  return built ? pkey : nullptr;
+}
+
+/**
+ * Encodes the public area of a TPM key as a PEM SubjectPublicKeyInfo so a
+ * verifier can pin it as the trust anchor for delegation statements.
+ */
+bool TPMPublicToPEM(const TPM2B_PUBLIC &pub, std::string &pem) {
+  SoftKey key;
+  key.pkey = TPMPublicToPKey(pub);
+  if (!key.pkey)
+    return false;
+
+  BIO *bio = BIO_new(BIO_s_mem());
+  char *data = nullptr;
+  bool written = bio && PEM_write_bio_PUBKEY(bio, key.pkey) == 1;
+  long len = written ? BIO_get_mem_data(bio, &data) : 0;
+  if (CheckSSL(written && len > 0, "Encode TPM public key"))
+    pem.assign(data, static_cast<size_t>(len));
+  BIO_free(bio);
+  return !pem.empty();
+}
+
+/**
+ * Reads the public area of the child key and encodes it as PEM.
+ */
+bool ReadChildPublic(EsysCtx &esys, ESYS_TR childHandle,
+                     TPM2B_PUBLIC **outPublic, std::string &pem) {
+  TPM2B_NAME *name = nullptr;
+  TPM2B_NAME *qualifiedName = nullptr;
+  if (!CheckRC(Esys_ReadPublic(esys.ctx, childHandle, ESYS_TR_NONE,
+                               ESYS_TR_NONE, ESYS_TR_NONE, outPublic, &name,
+                               &qualifiedName),
+               "ReadPublic"))
+    return false;
+  Esys_Free(name);
+  Esys_Free(qualifiedName);
+  if (!TPMPublicToPEM(**outPublic, pem)) {
+    Esys_Free(*outPublic);
+    *outPublic = nullptr;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Sets up @p signer from the command line delegation budget.
+ */
+void InitSigner(const Args &args, EsysCtx &esys, ESYS_TR childHandle,
+                ESYS_TR sessionHandle, DelegatedSigner &signer) {
+  signer.esys = &esys;
+  signer.childHandle = childHandle;
+  signer.sessionHandle = sessionHandle;
+  signer.keyAlg = args.keyAlg;
+  signer.budget.maxSignatures = args.delegateMaxSigs;
+  signer.budget.lifetime = std::chrono::seconds(args.delegateTtlSecs);
+}
+
+bool VerifySHA256(EVP_PKEY *pkey, const unsigned char *msg, size_t msgLen,
+                  const std::vector<unsigned char> &sig) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  bool verified =
+      ctx &&
+      EVP_DigestVerifyInit(ctx, nullptr, EVP_sha256(), nullptr, pkey) > 0 &&
+      EVP_DigestVerify(ctx, sig.data(), sig.size(), msg, msgLen) == 1;
+  EVP_MD_CTX_free(ctx);
+  ERR_clear_error();
+  return verified;
+}
+
+} // namespace
+
+bool CreateDelegation(EsysCtx &esys, ESYS_TR childHandle,
+                      ESYS_TR sessionHandle, TPM2_ALG_ID keyAlg,
+                      const DelegationBudget &budget, uint64_t serial,
+                      Delegation &delegation) {
+  if (budget.maxSignatures == 0 || budget.lifetime.count() <= 0) {
+    fail("Delegation: budget must allow at least one signature and second");
+    return false;
+  }
+
+  delegation.key.pkey = EVP_EC_gen("P-256");
+  if (!CheckSSL(delegation.key.pkey != nullptr, "Generate software key"))
+    return false;
+
+  unsigned char *spki = nullptr;
+  int spkiLen = i2d_PUBKEY(delegation.key.pkey, &spki);
+  if (!CheckSSL(spkiLen > 0, "Encode software public key"))
+    return false;
+
+  uint64_t now = NowUnix();
+  delegation.serial = serial;
+  delegation.notAfter = now + budget.lifetime.count();
+  delegation.maxSignatures = budget.maxSignatures;
+  delegation.used = 0;
+
+  std::vector<unsigned char> &st = delegation.statement;
+  st.assign(kStatementMagic, kStatementMagic + kStatementMagicLen);
+  PutU64(st, serial);
+  PutU64(st, now);
+  PutU64(st, delegation.notAfter);
+  PutU64(st, delegation.maxSignatures);
+  PutU32(st, static_cast<uint32_t>(spkiLen));
+  st.insert(st.end(), spki, spki + spkiLen);
+  OPENSSL_free(spki);
+
+  TPM2B_DIGEST digest{};
+  digest.size = SHA256_DIGEST_LENGTH;
+  SHA256(st.data(), st.size(), digest.buffer);
+
+  TPMT_SIGNATURE *signature = nullptr;
+  if (!TPMSignDigest(esys, childHandle, sessionHandle, keyAlg, digest,
+                     &signature))
+    return false;
+  delegation.tpmSignature = TPMSignatureBytes(*signature);
+  Esys_Free(signature);
+
+  if (delegation.tpmSignature.empty()) {
+    fail("Delegation: unsupported TPM signature algorithm");
+    return false;
+  }
+  return true;
+}
+
+bool DelegatedSign(DelegatedSigner &signer, const std::string &message,
+                   std::vector<unsigned char> &signature,
+                   std::shared_ptr<const Delegation> &delegation) {
+  std::shared_ptr<Delegation> d = signer.current.load();
+  while (!d || d->used.fetch_add(1) >= d->maxSignatures ||
+         NowUnix() >= d->notAfter) {
+    std::lock_guard<std::mutex> lock(signer.mu);
+    // Another thread may have rotated while we waited for the lock.
+    std::shared_ptr<Delegation> latest = signer.current.load();
+    if (latest == d) {
+      auto next = std::make_shared<Delegation>();
+      uint64_t serial = d ? d->serial + 1 : 1;
+      if (!CreateDelegation(*signer.esys, signer.childHandle,
+                            signer.sessionHandle, signer.keyAlg, signer.budget,
+                            serial, *next))
+        return false;
+      // The rotating thread takes the new key's first signature before
+      // publishing it, so neither other threads nor a second ticking over
+      // during TPM2_Sign can make it rotate again.
+      next->used = 1;
+      signer.current.store(next);
+      d = next;
+      break;
+    }
+    d = latest;
+  }
+
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  size_t sigLen = 0;
+  bool signedOk =
+      ctx &&
+      EVP_DigestSignInit(ctx, nullptr, EVP_sha256(), nullptr, d->key.pkey) >
+          0 &&
+      EVP_DigestSign(ctx, nullptr, &sigLen,
+                     reinterpret_cast<const unsigned char *>(message.data()),
+                     message.size()) > 0;
+  if (signedOk) {
+    signature.resize(sigLen);
+    signedOk = EVP_DigestSign(
+                   ctx, signature.data(), &sigLen,
+                   reinterpret_cast<const unsigned char *>(message.data()),
+                   message.size()) > 0;
+    signature.resize(sigLen);
+  }
+  EVP_MD_CTX_free(ctx);
+  if (!CheckSSL(signedOk, "Software sign"))
+    return false;
+
+  delegation = d;
+  return true;
+}
+
+bool VerifyDelegated(const TPM2B_PUBLIC &tpmKey,
+                     const std::vector<unsigned char> &statement,
+                     const std::vector<unsigned char> &tpmSignature,
+                     const std::string &message,
+                     const std::vector<unsigned char> &signature,
+                     uint64_t now) {
+  Statement st;
+  if (!ParseStatement(statement, st)) {
+    fail("Delegation verify: malformed statement");
+    return false;
+  }
+  if (now < st.notBefore || now >= st.notAfter) {
+    fail("Delegation verify: statement outside validity window");
+    return false;
+  }
+
+  SoftKey tpmPKey;
+  tpmPKey.pkey = TPMPublicToPKey(tpmKey);
+  if (!tpmPKey.pkey)
+    return false;
+  if (!VerifySHA256(tpmPKey.pkey, statement.data(), statement.size(),
+                    tpmSignature)) {
+    fail("Delegation verify: TPM signature mismatch");
+    return false;
+  }
+
+  SoftKey softPKey;
+  const unsigned char *p = st.spki;
+  softPKey.pkey = d2i_PUBKEY(nullptr, &p, static_cast<long>(st.spkiLen));
+  if (!CheckSSL(softPKey.pkey != nullptr, "Decode delegated public key"))
+    return false;
+  if (!VerifySHA256(softPKey.pkey,
+                    reinterpret_cast<const unsigned char *>(message.data()),
+                    message.size(), signature)) {
+    fail("Delegation verify: software signature mismatch");
+    return false;
+  }
+  return true;
+}
+
+bool TPMDelegateSignMessage(Args &args, EsysCtx &esys, ESYS_TR &childHandle,
+                            ESYS_TR &sessionHandle) {
+  DelegatedSigner signer;
+  InitSigner(args, esys, childHandle, sessionHandle, signer);
+
+  std::vector<unsigned char> signature;
+  std::shared_ptr<const Delegation> delegation;
+  if (!DelegatedSign(signer, args.message, signature, delegation))
+    return false;
+  // Verify at signing time; printing and ReadPublic must not age it out.
+  uint64_t signedAt = NowUnix();
+
+  // The statement is only meaningful next to the key that certified it.
+  TPM2B_PUBLIC *outPublic = nullptr;
+  std::string childPem;
+  if (!ReadChildPublic(esys, childHandle, &outPublic, childPem))
+    return false;
+
+  ok("Software Key Delegated by TPM");
+  kv("Delegation Serial", std::to_string(delegation->serial));
+  kv("Max Signatures", std::to_string(delegation->maxSignatures));
+  kv("Not After", std::to_string(delegation->notAfter));
+  std::println(stdout, "{}Delegation Statement:{}", CYAN, RESET);
+  PrintHex(delegation->statement.data(), delegation->statement.size());
+  std::println(stdout, "{}TPM Signature:{}", CYAN, RESET);
+  PrintHex(delegation->tpmSignature.data(), delegation->tpmSignature.size());
+  std::println(stdout, "{}TPM Child Public Key:{}", CYAN, RESET);
+  std::print(stdout, "{}", childPem);
+
+  ok("Message Signed with Delegated Key (ECDSA P-256 / SHA256)");
+  kv("Signature Size", std::to_string(signature.size()));
+  std::println(stdout, "{}Signature:{}", CYAN, RESET);
+  PrintHex(signature.data(), signature.size());
+
+  bool verified =
+      VerifyDelegated(*outPublic, delegation->statement,
+                      delegation->tpmSignature, args.message, signature,
+                      signedAt);
+  Esys_Free(outPublic);
+  if (!verified)
+    return false;
+  ok("Delegation and Signature Verified");
+
+  return true;
+}
+
+bool TPMDelegateSignManifest(Args &args, EsysCtx &esys, ESYS_TR &childHandle,
+                             ESYS_TR &sessionHandle) {
+  std::ifstream manifest(args.manifestPath);
+  if (!manifest) {
+    fail("Open manifest: " + args.manifestPath);
+    return false;
+  }
+  std::ofstream out(args.delegateOutPath, std::ios::trunc);
+  if (!out) {
+    fail("Open output: " + args.delegateOutPath);
+    return false;
+  }
+
+  TPM2B_PUBLIC *outPublic = nullptr;
+  std::string childPem;
+  if (!ReadChildPublic(esys, childHandle, &outPublic, childPem))
+    return false;
+  Esys_Free(outPublic);
+  out << childPem;
+
+  DelegatedSigner signer;
+  InitSigner(args, esys, childHandle, sessionHandle, signer);
+  unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+
+  struct Item {
+    std::vector<unsigned char> signature;
+    std::shared_ptr<const Delegation> delegation;
+  };
+  std::vector<std::string> lines;
+  std::vector<Item> items;
+  uint64_t index = 0;
+  uint64_t lastSerial = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (;;) {
+    lines.clear();
+    std::string line;
+    while (lines.size() < kDelegateBatch && std::getline(manifest, line))
+      lines.push_back(std::move(line));
+    if (lines.empty())
+      break;
+
+    items.assign(lines.size(), Item{});
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    auto work = [&] {
+      for (size_t i; !failed && (i = next.fetch_add(1)) < lines.size();)
+        if (!DelegatedSign(signer, lines[i], items[i].signature,
+                           items[i].delegation))
+          failed = true;
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < workers; t++)
+      pool.emplace_back(work);
+    work();
+    for (std::thread &t : pool)
+      t.join();
+    if (failed) {
+      fail("Stopped in the batch starting at item " + std::to_string(index));
+      return false;
+    }
+
+    // Keys certified during this batch, written before any item they signed.
+    std::map<uint64_t, const Delegation *> fresh;
+    for (const Item &item : items)
+      if (item.delegation->serial > lastSerial)
+        fresh.emplace(item.delegation->serial, item.delegation.get());
+    for (const auto &[serial, d] : fresh)
+      out << "delegation " << serial << " " << ToHex(d->statement) << " "
+          << ToHex(d->tpmSignature) << "\n";
+    if (!fresh.empty())
+      lastSerial = fresh.rbegin()->first;
+
+    for (const Item &item : items)
+      out << index++ << " " << item.delegation->serial << " "
+          << ToHex(item.signature) << "\n";
+  }
+
+  out.flush();
+  if (!out) {
+    fail("Write output: " + args.delegateOutPath);
+    return false;
+  }
+  double secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+
+  ok("Manifest Signed with Delegated Keys (ECDSA P-256 / SHA256)");
+  kv("Items", std::to_string(index));
+  kv("Threads", std::to_string(workers));
+  kv("Delegations", std::to_string(lastSerial));
+  kv("Signatures/sec",
+     std::to_string(static_cast<uint64_t>(secs > 0 ? index / secs : 0)));
+  kv("Output", args.delegateOutPath);
+  return true;
+}
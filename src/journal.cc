@@ -0,0 +1,284 @@
+#include "journal.h"
+#include "tpm.h"
+#include "ui.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <string_view>
+#include <sys/stat.h>
+
+namespace {
+
+constexpr char kJournalMagic[] = "tpm-sign-journal 1 ";
+constexpr size_t kCheckLen = 8;
+
+bool CheckErrno(bool success, const char *what) {
+  if (!success)
+    fail(std::string(what) + ": " + std::strerror(errno));
+  return success;
+}
+
+/**
+ * Writes all of @p data at the current offset, retrying on EINTR and short
+ * writes.
+ */
+bool WriteAll(int fd, const std::string &data, const char *what) {
+  size_t off = 0;
+  while (off < data.size()) {
+    ssize_t n = write(fd, data.data() + off, data.size() - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (!CheckErrno(n > 0, what))
+      return false;
+    off += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+std::string ToHex(const unsigned char *p, size_t n) {
+  static const char digits[] = "0123456789abcdef";
+  std::string out(n * 2, '0');
+  for (size_t i = 0; i < n; i++) {
+    out[2 * i] = digits[p[i] >> 4];
+    out[2 * i + 1] = digits[p[i] & 0xf];
+  }
+  return out;
+}
+
+bool FromHex(const std::string &hex, unsigned char *out, size_t cap,
+             size_t &n) {
+  auto nibble = [](char c) -> int {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    return -1;
+  };
+  if (hex.size() % 2 != 0 || hex.size() / 2 > cap)
+    return false;
+  n = hex.size() / 2;
+  for (size_t i = 0; i < n; i++) {
+    int hi = nibble(hex[2 * i]);
+    int lo = nibble(hex[2 * i + 1]);
+    if (hi < 0 || lo < 0)
+      return false;
+    out[i] = static_cast<unsigned char>((hi << 4) | lo);
+  }
+  return true;
+}
+
+std::string RecordCheck(const std::string &body) {
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char *>(body.data()), body.size(),
+         hash);
+  return ToHex(hash, kCheckLen / 2);
+}
+
+/**
+ * Parses one journal line (without the trailing newline).
+ */
+bool ParseRecord(const std::string &line, JournalRecord &record) {
+  if (line.size() < kCheckLen + 1 || line[line.size() - kCheckLen - 1] != ' ')
+    return false;
+  std::string body = line.substr(0, line.size() - kCheckLen - 1);
+  if (RecordCheck(body) != line.substr(line.size() - kCheckLen))
+    return false;
+
+  size_t sp1 = body.find(' ');
+  if (sp1 == std::string::npos || sp1 == 0)
+    return false;
+  size_t sp2 = body.find(' ', sp1 + 1);
+  if (sp2 == std::string::npos)
+    return false;
+
+  std::string index = body.substr(0, sp1);
+  if (index.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  record.index = std::stoull(index);
+
+  size_t n = 0;
+  if (!FromHex(body.substr(sp1 + 1, sp2 - sp1 - 1), record.digest.buffer,
+               sizeof(record.digest.buffer), n) ||
+      n != SHA256_DIGEST_LENGTH)
+    return false;
+  record.digest.size = static_cast<uint16_t>(n);
+
+  std::string sigHex = body.substr(sp2 + 1);
+  record.signature.resize(sigHex.size() / 2);
+  if (!FromHex(sigHex, record.signature.data(), record.signature.size(), n))
+    return false;
+  return !record.signature.empty();
+}
+
+} // namespace
+
+bool OpenJournal(const std::string &path, const std::string &keyName,
+                 Journal &journal) {
+  journal.fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (!CheckErrno(journal.fd >= 0, "Open journal"))
+    return false;
+
+  std::string data;
+  {
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = read(journal.fd, buf, sizeof(buf))) > 0)
+      data.append(buf, static_cast<size_t>(n));
+    if (!CheckErrno(n == 0, "Read journal"))
+      return false;
+  }
+
+  const std::string header = kJournalMagic + keyName + "\n";
+  const std::string_view magic = kJournalMagic;
+  // A crash while writing the header leaves a prefix of it and no records.
+  // Anything without a complete header line that still looks like ours is
+  // safe to start over.
+  bool tornHeader = data.find('\n') == std::string::npos &&
+                    (data.starts_with(magic) || magic.starts_with(data));
+  if (tornHeader) {
+    if (!data.empty())
+      warn("Journal header incomplete; rewriting");
+    if (!CheckErrno(ftruncate(journal.fd, 0) == 0, "Truncate journal") ||
+        !CheckErrno(lseek(journal.fd, 0, SEEK_SET) == 0, "Seek journal") ||
+        !WriteAll(journal.fd, header, "Write journal header"))
+      return false;
+    return SyncJournal(journal);
+  }
+  if (data.compare(0, header.size(), header) != 0) {
+    if (data.starts_with(kJournalMagic))
+      fail("Journal: " + path + " was written with a different key");
+    else
+      fail("Journal: " + path + " is not a tpm-sign journal");
+    return false;
+  }
+
+  off_t validEnd = static_cast<off_t>(header.size());
+  size_t pos = header.size();
+  while (pos < data.size()) {
+    size_t nl = data.find('\n', pos);
+    if (nl == std::string::npos)
+      break;
+    JournalRecord record;
+    if (!ParseRecord(data.substr(pos, nl - pos), record) ||
+        record.index != journal.nextIndex)
+      break;
+    journal.last = std::move(record);
+    journal.hasLast = true;
+    journal.nextIndex++;
+    pos = nl + 1;
+    validEnd = static_cast<off_t>(pos);
+  }
+
+  if (static_cast<size_t>(validEnd) != data.size()) {
+    warn("Journal tail invalid; discarding " +
+         std::to_string(data.size() - validEnd) + " bytes");
+    if (!CheckErrno(ftruncate(journal.fd, validEnd) == 0, "Truncate journal"))
+      return false;
+    if (!SyncJournal(journal))
+      return false;
+  }
+  return CheckErrno(lseek(journal.fd, validEnd, SEEK_SET) == validEnd,
+                    "Seek journal");
+}
+
+bool AppendJournal(Journal &journal, const JournalRecord &record) {
+  std::string body = std::to_string(record.index) + " " +
+                     ToHex(record.digest.buffer, record.digest.size) + " " +
+                     ToHex(record.signature.data(), record.signature.size());
+  std::string line = body + " " + RecordCheck(body) + "\n";
+
+  if (!WriteAll(journal.fd, line, "Append journal"))
+    return false;
+
+  journal.nextIndex = record.index + 1;
+  if (++journal.unsynced >= kJournalSyncInterval)
+    return SyncJournal(journal);
+  return true;
+}
+
+bool SyncJournal(Journal &journal) {
+  if (!CheckErrno(fsync(journal.fd) == 0, "Sync journal"))
+    return false;
+  journal.unsynced = 0;
+  return true;
+}
+
+bool TPMSignManifest(Args &args, EsysCtx &esys, ESYS_TR &childHandle,
+                     ESYS_TR &sessionHandle) {
+  std::ifstream manifest(args.manifestPath);
+  if (!manifest) {
+    fail("Open manifest: " + args.manifestPath);
+    return false;
+  }
+
+  std::string keyName;
+  {
+    TPM2B_NAME *name = nullptr;
+    if (!CheckRC(Esys_TR_GetName(esys.ctx, childHandle, &name), "GetName"))
+      return false;
+    keyName = ToHex(name->name, name->size);
+    Esys_Free(name);
+  }
+
+  Journal journal;
+  if (!OpenJournal(args.journalPath, keyName, journal))
+    return false;
+  ok("Journal Opened");
+  kv("Journal", args.journalPath);
+  kv("Resume Index", std::to_string(journal.nextIndex));
+
+  uint64_t index = 0;
+  uint64_t signedCount = 0;
+  std::string line;
+  for (; std::getline(manifest, line); index++) {
+    if (index < journal.nextIndex) {
+      if (journal.hasLast && index == journal.last.index) {
+        TPM2B_DIGEST digest = SHA256ToTPMDigest(line);
+        if (digest.size != journal.last.digest.size ||
+            std::memcmp(digest.buffer, journal.last.digest.buffer,
+                        digest.size) != 0) {
+          fail("Journal does not match manifest at item " +
+               std::to_string(index));
+          return false;
+        }
+      }
+      continue;
+    }
+
+    JournalRecord record;
+    record.index = index;
+    record.digest = SHA256ToTPMDigest(line);
+
+    TPMT_SIGNATURE *signature = nullptr;
+    if (!TPMSignDigest(esys, childHandle, sessionHandle, args.keyAlg,
+                       record.digest, &signature)) {
+      fail("Stopped at item " + std::to_string(index) +
+           "; rerun to resume from the journal");
+      return false;
+    }
+    record.signature = TPMSignatureBytes(*signature);
+    Esys_Free(signature);
+
+    if (record.signature.empty()) {
+      fail("Journal: unsupported TPM signature algorithm");
+      return false;
+    }
+    if (!AppendJournal(journal, record))
+      return false;
+    signedCount++;
+  }
+
+  if (index < journal.nextIndex) {
+    fail("Journal has more records than the manifest has items");
+    return false;
+  }
+  if (!SyncJournal(journal))
+    return false;
+
+  ok("Manifest Signed");
+  kv("Items", std::to_string(index));
+  kv("Skipped (journaled)", std::to_string(index - signedCount));
+  kv("Signed", std::to_string(signedCount));
+  return true;
+}
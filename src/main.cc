@@ -1,13 +1,22 @@
+#include "delegate.h"
+#include "journal.h"
+#include "probe.h"
+#include "shm_server.h"
 #include "tpm.h"
 #include "ui.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <limits>
 #include <print>
 #include <string>
 #include <tss2/tss2_esys.h>
 #include <tss2/tss2_rc.h>
 #include <tss2/tss2_tctildr.h>
 
-const int kTotalSteps = 8;
+const int kTotalSteps = 9;
 
 /**
  * Pauses the TUI until user inputs a character. If
@@ -27,6 +36,25 @@ static void PauseIfNeeded(bool autoMode);
  */
 static bool ParseArgs(int argc, char *argv[], Args &a);
 
+/**
+ * Prints the command line usage to stderr.
+ *
+ * @param prog The program name (argv[0]).
+ */
+static void PrintUsage(const char *prog);
+
+/**
+ * Parses a decimal count.
+ *
+ * @param s The string to parse.
+ * @param min The smallest accepted value.
+ * @param max The largest accepted value.
+ * @param out Output parameter that receives the value.
+ * @return True if @p s is a whole number in [@p min, @p max], false otherwise.
+ */
+static bool ParseCount(const char *s, uint64_t min, uint64_t max,
+                       uint64_t &out);
+
 int main(int argc, char *argv[]) {
   Args args;
   if (!ParseArgs(argc, argv, args))
@@ -60,16 +88,40 @@ int main(int argc, char *argv[]) {
     return 1;
   PauseIfNeeded(args.autoMode);
 
-  header(6, kTotalSteps,
+  header(6, kTotalSteps, "Select signing profile (GetCapability + probe)");
+  TPMProfile profile;
+  if (!TPMSelectProfile(args, esys, primaryHandle, sessionHandle, profile))
+    return 1;
+  PauseIfNeeded(args.autoMode);
+
+  header(7, kTotalSteps,
          "Create + Load child signing key (authorized by HMAC)");
   ESYS_TR childHandle;
   if (!TPMCreateLoad(args, esys, primaryHandle, sessionHandle, childHandle))
     return 1;
   PauseIfNeeded(args.autoMode);
 
-  header(7, kTotalSteps, "Signing Message");
-  if (!TPMSignMessage(args, esys, childHandle, sessionHandle))
-    return 1;
+  if (!args.shmName.empty()) {
+    header(8, kTotalSteps, "Serving shared-memory ring");
+    if (!TPMServeShm(args, esys, childHandle, sessionHandle))
+      return 1;
+  } else if (!args.manifestPath.empty() && args.delegateMode) {
+    header(8, kTotalSteps, "Signing Manifest (TPM-delegated software keys)");
+    if (!TPMDelegateSignManifest(args, esys, childHandle, sessionHandle))
+      return 1;
+  } else if (!args.manifestPath.empty()) {
+    header(8, kTotalSteps, "Signing Manifest (journaled)");
+    if (!TPMSignManifest(args, esys, childHandle, sessionHandle))
+      return 1;
+  } else if (args.delegateMode) {
+    header(8, kTotalSteps, "Signing Message (TPM-delegated software key)");
+    if (!TPMDelegateSignMessage(args, esys, childHandle, sessionHandle))
+      return 1;
+  } else {
+    header(8, kTotalSteps, "Signing Message");
+    if (!TPMSignMessage(args, esys, childHandle, sessionHandle))
+      return 1;
+  }
   PauseIfNeeded(args.autoMode);
 
   header(kTotalSteps, kTotalSteps, "Cleanup (Flush Context)");
@@ -95,23 +147,130 @@ static bool ParseArgs(int argc, char *argv[], Args &a) {
   for (int i = 1; i < argc; i++) {
     if (std::strcmp(argv[i], "--auto") == 0) {
       a.autoMode = true;
+    } else if (std::strcmp(argv[i], "--delegate") == 0) {
+      a.delegateMode = true;
+    } else if (std::strcmp(argv[i], "--delegate-max-sigs") == 0 &&
+               i + 1 < argc) {
+      if (!ParseCount(argv[++i], 1, UINT64_MAX, a.delegateMaxSigs)) {
+        std::println(stderr, "--delegate-max-sigs must be a positive number");
+        PrintUsage(argv[0]);
+        return false;
+      }
+    } else if (std::strcmp(argv[i], "--delegate-ttl") == 0 && i + 1 < argc) {
+      // notAfter = now + ttl must not overflow the statement's Unix time.
+      uint64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+                         std::chrono::system_clock::now().time_since_epoch())
+                         .count();
+      uint64_t maxTtl = std::numeric_limits<int64_t>::max() - now;
+      if (!ParseCount(argv[++i], kMinDelegationTtlSecs, maxTtl,
+                      a.delegateTtlSecs)) {
+        std::println(stderr,
+                     "--delegate-ttl must be at least {} seconds and must "
+                     "not overflow the clock",
+                     kMinDelegationTtlSecs);
+        PrintUsage(argv[0]);
+        return false;
+      }
+    } else if (std::strcmp(argv[i], "--probe") == 0) {
+      a.probe = true;
+    } else if (std::strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      a.profilePath = argv[++i];
+    } else if (std::strcmp(argv[i], "--serve-shm") == 0 && i + 1 < argc) {
+      a.shmName = argv[++i];
+    } else if (std::strcmp(argv[i], "--manifest") == 0 && i + 1 < argc) {
+      a.manifestPath = argv[++i];
+    } else if (std::strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+      a.journalPath = argv[++i];
     } else if (a.message.empty()) {
       a.message = argv[i];
     }
   }
 
-  if (a.message.empty()) {
-    std::println(stderr, "Usage: {} [--auto] <message>", argv[0]);
+  int modes = !a.message.empty() + !a.manifestPath.empty() + !a.shmName.empty();
+  if (modes != 1) {
+    PrintUsage(argv[0]);
+    return false;
+  }
+  if (a.delegateMode && !a.shmName.empty()) {
+    std::println(stderr, "--delegate cannot be combined with --serve-shm");
+    PrintUsage(argv[0]);
+    return false;
+  }
+  if (a.delegateMode && !a.journalPath.empty()) {
+    std::println(stderr, "--delegate cannot be combined with --journal");
+    PrintUsage(argv[0]);
     return false;
   }
+  if (a.delegateMode && !a.manifestPath.empty()) {
+    a.delegateOutPath = a.manifestPath + ".delegated";
+  } else if (!a.manifestPath.empty()) {
+    if (a.journalPath.empty())
+      a.journalPath = a.manifestPath + ".journal";
+    a.childKeyPath = a.journalPath + ".key";
+  }
+  if (a.profilePath.empty()) {
+    const char *cache = std::getenv("XDG_CACHE_HOME");
+    const char *home = std::getenv("HOME");
+    if (cache && *cache)
+      a.profilePath = std::string(cache) + "/tpm-sign/profile";
+    else if (home && *home)
+      a.profilePath = std::string(home) + "/.cache/tpm-sign/profile";
+    else
+      a.profilePath = "tpm-sign.profile";
+  }
 
   header(1, kTotalSteps, "Input & Configuration");
   kv("Auto Mode:", a.autoMode ? "Active" : "Inactive");
-  kv("Message: ", "\"" + a.message + "\"");
+  if (!a.shmName.empty()) {
+    kv("Shared-Memory Ring: ", a.shmName);
+  } else if (a.manifestPath.empty()) {
+    kv("Message: ", "\"" + a.message + "\"");
+  } else if (a.delegateMode) {
+    kv("Manifest: ", a.manifestPath);
+    kv("Output: ", a.delegateOutPath);
+  } else {
+    kv("Manifest: ", a.manifestPath);
+    kv("Journal: ", a.journalPath);
+    kv("Key Blob: ", a.childKeyPath);
+  }
+  kv("Profile: ", a.profilePath + (a.probe ? " (re-probe)" : ""));
+  if (a.delegateMode) {
+    kv("Delegation:", "Active");
+    kv("Delegate Max Sigs:", std::to_string(a.delegateMaxSigs));
+    kv("Delegate TTL (s):", std::to_string(a.delegateTtlSecs));
+  }
 
   return true;
 }
 
+static void PrintUsage(const char *prog) {
+  std::println(stderr,
+               "Usage: {} [--auto] [--probe] [--profile FILE] "
+               "[--delegate [--delegate-max-sigs N] "
+               "[--delegate-ttl SECONDS]] <message>\n"
+               "       {} [--auto] [--probe] [--profile FILE] "
+               "--manifest FILE [--journal FILE]\n"
+               "       {} [--auto] [--probe] [--profile FILE] "
+               "--delegate [--delegate-max-sigs N] "
+               "[--delegate-ttl SECONDS] --manifest FILE\n"
+               "       {} [--auto] [--probe] [--profile FILE] "
+               "--serve-shm NAME",
+               prog, prog, prog, prog);
+}
+
+static bool ParseCount(const char *s, uint64_t min, uint64_t max,
+                       uint64_t &out) {
+  if (*s < '0' || *s > '9')
+    return false;
+  errno = 0;
+  char *end = nullptr;
+  unsigned long long v = std::strtoull(s, &end, 10);
+  if (errno == ERANGE || *end != '\0' || v < min || v > max)
+    return false;
+  out = v;
+  return true;
+}
+
 static void PauseIfNeeded(bool autoMode) {
   if (autoMode)
     return;
@@ -0,0 +1,300 @@
+#include "probe.h"
+#include "tpm.h"
+#include "ui.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+
+namespace {
+
+using PropertyMap = std::map<uint32_t, uint32_t>;
+
+/**
+ * Reads the TPM properties in [first, last] into @p out, following
+ * moreData until the range is exhausted.
+ */
+bool GetProperties(EsysCtx &esys, uint32_t first, uint32_t last,
+                   PropertyMap &out) {
+  uint32_t next = first;
+  TPMI_YES_NO more = 1;
+  while (more && next <= last) {
+    TPMS_CAPABILITY_DATA *data = nullptr;
+    if (!CheckRC(Esys_GetCapability(esys.ctx, ESYS_TR_NONE, ESYS_TR_NONE,
+                                    ESYS_TR_NONE, TPM2_CAP_TPM_PROPERTIES, next,
+                                    TPM2_MAX_TPM_PROPERTIES, &more, &data),
+                 "GetCapability (properties)"))
+      return false;
+
+    const TPML_TAGGED_TPM_PROPERTY &props = data->data.tpmProperties;
+    if (props.count == 0)
+      more = 0;
+    for (uint32_t i = 0; i < props.count; i++) {
+      if (props.tpmProperty[i].property > last) {
+        more = 0;
+        break;
+      }
+      out[props.tpmProperty[i].property] = props.tpmProperty[i].value;
+      next = props.tpmProperty[i].property + 1;
+    }
+    Esys_Free(data);
+  }
+  return true;
+}
+
+bool GetAlgorithms(EsysCtx &esys, std::set<TPM2_ALG_ID> &out) {
+  uint32_t next = 0;
+  TPMI_YES_NO more = 1;
+  while (more) {
+    TPMS_CAPABILITY_DATA *data = nullptr;
+    if (!CheckRC(Esys_GetCapability(esys.ctx, ESYS_TR_NONE, ESYS_TR_NONE,
+                                    ESYS_TR_NONE, TPM2_CAP_ALGS, next,
+                                    TPM2_MAX_CAP_ALGS, &more, &data),
+                 "GetCapability (algorithms)"))
+      return false;
+
+    const TPML_ALG_PROPERTY &algs = data->data.algorithms;
+    if (algs.count == 0)
+      more = 0;
+    for (uint32_t i = 0; i < algs.count; i++) {
+      out.insert(algs.algProperties[i].alg);
+      next = algs.algProperties[i].alg + 1u;
+    }
+    Esys_Free(data);
+  }
+  return true;
+}
+
+bool HasCurve(EsysCtx &esys, TPM2_ECC_CURVE curve, bool &found) {
+  TPMS_CAPABILITY_DATA *data = nullptr;
+  TPMI_YES_NO more = 0;
+  found = false;
+  if (!CheckRC(Esys_GetCapability(esys.ctx, ESYS_TR_NONE, ESYS_TR_NONE,
+                                  ESYS_TR_NONE, TPM2_CAP_ECC_CURVES, curve, 1,
+                                  &more, &data),
+               "GetCapability (curves)"))
+    return false;
+  found = data->data.eccCurves.count > 0 &&
+          data->data.eccCurves.eccCurves[0] == curve;
+  Esys_Free(data);
+  return true;
+}
+
+uint32_t Property(const PropertyMap &props, uint32_t property) {
+  auto it = props.find(property);
+  return it == props.end() ? 0 : it->second;
+}
+
+/**
+ * Reads the TPM identity and its current resource limits into @p profile and
+ * sizes the key-slot cache and concurrency from them.
+ */
+bool ReadLimits(EsysCtx &esys, TPMProfile &profile) {
+  PropertyMap props;
+  if (!GetProperties(esys, TPM2_PT_FIXED, TPM2_PT_FIXED + 0xff, props) ||
+      !GetProperties(esys, TPM2_PT_VAR, TPM2_PT_VAR + 0xff, props))
+    return false;
+
+  profile.manufacturer = Property(props, TPM2_PT_MANUFACTURER);
+  profile.firmware1 = Property(props, TPM2_PT_FIRMWARE_VERSION_1);
+  profile.firmware2 = Property(props, TPM2_PT_FIRMWARE_VERSION_2);
+  profile.transientAvail = Property(props, TPM2_PT_HR_TRANSIENT_AVAIL);
+  profile.loadedAvail = Property(props, TPM2_PT_HR_LOADED_AVAIL);
+  profile.activeSessionsMax = Property(props, TPM2_PT_ACTIVE_SESSIONS_MAX);
+  profile.maxDigest = Property(props, TPM2_PT_MAX_DIGEST);
+  profile.maxCommandSize = Property(props, TPM2_PT_MAX_COMMAND_SIZE);
+
+  // The primary and our session are already loaded, so the available counts
+  // are what is left for child keys and extra sessions.
+  profile.keySlots = std::max<uint32_t>(1, profile.transientAvail);
+  uint32_t sessions = profile.loadedAvail + 1;
+  if (profile.activeSessionsMax)
+    sessions = std::min(sessions, profile.activeSessionsMax);
+  profile.concurrency = std::max<uint32_t>(
+      1, std::min(profile.keySlots, sessions));
+  return true;
+}
+
+/**
+ * Creates a child key of @p keyAlg, times kProbeSigns signatures with it and
+ * flushes it again.
+ */
+bool BenchProfile(EsysCtx &esys, ESYS_TR primaryHandle, ESYS_TR sessionHandle,
+                  TPM2_ALG_ID keyAlg, double &signsPerSec) {
+  Args benchArgs;
+  benchArgs.autoMode = true;
+  benchArgs.keyAlg = keyAlg;
+  ESYS_TR childHandle = ESYS_TR_NONE;
+  if (!TPMCreateLoad(benchArgs, esys, primaryHandle, sessionHandle,
+                     childHandle))
+    return false;
+
+  TPM2B_DIGEST digest = SHA256ToTPMDigest("tpm-sign probe");
+  bool signedAll = true;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kProbeSigns && signedAll; i++) {
+    TPMT_SIGNATURE *signature = nullptr;
+    signedAll = TPMSignDigest(esys, childHandle, sessionHandle, keyAlg, digest,
+                              &signature);
+    Esys_Free(signature);
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  bool flushed = CheckRC(Esys_FlushContext(esys.ctx, childHandle),
+                         "Flush Context (Probe)");
+  if (!signedAll || !flushed)
+    return false;
+
+  signsPerSec = kProbeSigns / std::max(elapsed.count(), 1e-9);
+  return true;
+}
+
+} // namespace
+
+bool TPMProbe(EsysCtx &esys, ESYS_TR primaryHandle, ESYS_TR sessionHandle,
+              TPMProfile &profile) {
+  if (!ReadLimits(esys, profile))
+    return false;
+  ok("TPM2_GetCapability (properties) Success");
+
+  if (profile.maxDigest != 0 && profile.maxDigest < SHA256_DIGEST_LENGTH) {
+    fail("TPM does not support SHA-256 sized digests");
+    return false;
+  }
+
+  std::set<TPM2_ALG_ID> algs;
+  bool p256 = false;
+  if (!GetAlgorithms(esys, algs) || !HasCurve(esys, TPM2_ECC_NIST_P256, p256))
+    return false;
+  ok("TPM2_GetCapability (algorithms) Success");
+
+  std::vector<TPM2_ALG_ID> candidates;
+  if (algs.contains(TPM2_ALG_RSA) && algs.contains(TPM2_ALG_RSASSA))
+    candidates.push_back(TPM2_ALG_RSA);
+  if (algs.contains(TPM2_ALG_ECC) && algs.contains(TPM2_ALG_ECDSA) && p256)
+    candidates.push_back(TPM2_ALG_ECC);
+  if (!algs.contains(TPM2_ALG_SHA256) || candidates.empty()) {
+    fail("TPM supports no SHA-256 signing profile");
+    return false;
+  }
+
+  if (profile.transientAvail == 0) {
+    warn("No free transient slot to benchmark in; using " +
+         TPMAlgToString(candidates.front()));
+    profile.keyAlg = candidates.front();
+    return true;
+  }
+
+  profile.signsPerSec = 0;
+  for (TPM2_ALG_ID keyAlg : candidates) {
+    double rate = 0;
+    if (!BenchProfile(esys, primaryHandle, sessionHandle, keyAlg, rate)) {
+      warn("Benchmark failed for " + TPMAlgToString(keyAlg));
+      continue;
+    }
+    kv(TPMAlgToString(keyAlg) + " signs/sec", std::to_string(rate));
+    if (rate > profile.signsPerSec) {
+      profile.signsPerSec = rate;
+      profile.keyAlg = keyAlg;
+    }
+  }
+  if (profile.signsPerSec == 0) {
+    fail("No signing profile could be benchmarked");
+    return false;
+  }
+  return true;
+}
+
+bool SaveProfile(const std::string &path, const TPMProfile &profile) {
+  std::error_code ec;
+  std::filesystem::path parent = std::filesystem::path(path).parent_path();
+  if (!parent.empty())
+    std::filesystem::create_directories(parent, ec);
+
+  std::ofstream out(path, std::ios::trunc);
+  out << "manufacturer=" << profile.manufacturer << "\n"
+      << "firmware1=" << profile.firmware1 << "\n"
+      << "firmware2=" << profile.firmware2 << "\n"
+      << "keyAlg=" << TPMAlgToString(profile.keyAlg) << "\n"
+      << "signsPerSec=" << profile.signsPerSec << "\n";
+  out.close();
+  if (!out) {
+    warn("Could not save profile to " + path);
+    return false;
+  }
+  return true;
+}
+
+bool LoadProfile(const std::string &path, TPMProfile &profile) {
+  std::ifstream in(path);
+  if (!in)
+    return false;
+
+  std::map<std::string, std::string> fields;
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t eq = line.find('=');
+    if (eq != std::string::npos)
+      fields[line.substr(0, eq)] = line.substr(eq + 1);
+  }
+
+  try {
+    profile.manufacturer = std::stoul(fields.at("manufacturer"));
+    profile.firmware1 = std::stoul(fields.at("firmware1"));
+    profile.firmware2 = std::stoul(fields.at("firmware2"));
+    profile.keyAlg =
+        fields.at("keyAlg") == "ECC" ? TPM2_ALG_ECC : TPM2_ALG_RSA;
+    profile.signsPerSec = std::stod(fields.at("signsPerSec"));
+  } catch (const std::exception &) {
+    warn("Ignoring malformed profile " + path);
+    return false;
+  }
+  return true;
+}
+
+bool TPMSelectProfile(Args &args, EsysCtx &esys, ESYS_TR primaryHandle,
+                      ESYS_TR sessionHandle, TPMProfile &profile) {
+  // Limits are read fresh on every run; only the benchmark is cached.
+  TPMProfile current;
+  if (!ReadLimits(esys, current))
+    return false;
+
+  bool cached = false;
+  TPMProfile saved;
+  if (!args.probe && LoadProfile(args.profilePath, saved)) {
+    cached = saved.manufacturer == current.manufacturer &&
+             saved.firmware1 == current.firmware1 &&
+             saved.firmware2 == current.firmware2;
+    if (!cached)
+      warn("Cached profile is for a different TPM; re-probing");
+  }
+
+  if (cached) {
+    profile = current;
+    profile.keyAlg = saved.keyAlg;
+    profile.signsPerSec = saved.signsPerSec;
+    ok("Using Cached Signing Profile");
+  } else {
+    profile = TPMProfile{};
+    if (!TPMProbe(esys, primaryHandle, sessionHandle, profile))
+      return false;
+    ok("TPM Probed");
+    if (SaveProfile(args.profilePath, profile))
+      ok("Signing Profile Saved");
+  }
+
+  args.keyAlg = profile.keyAlg;
+  kv("Profile", args.profilePath);
+  kv("Key Type", TPMAlgToString(profile.keyAlg));
+  kv("Signs/sec", std::to_string(profile.signsPerSec));
+  kv("Transient Slots", std::to_string(profile.transientAvail));
+  kv("Session Slots", std::to_string(profile.loadedAvail));
+  kv("Max Digest", std::to_string(profile.maxDigest));
+  kv("Max Command Size", std::to_string(profile.maxCommandSize));
+  kv("Key Slots", std::to_string(profile.keySlots));
+  kv("Concurrency", std::to_string(profile.concurrency));
+  return true;
+}
@@ -0,0 +1,242 @@
+#include "shm_server.h"
+#include "tpm.h"
+#include "ui.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <new>
+#include <print>
+#include <sys/file.h>
+
+namespace {
+
+volatile std::sig_atomic_t gStop = 0;
+
+void OnStopSignal(int) { gStop = 1; }
+
+/**
+ * Signs the request in @p slot and writes the result back in place.
+ */
+void ServeSlot(EsysCtx &esys, ESYS_TR childHandle, ESYS_TR sessionHandle,
+               TPM2_ALG_ID keyAlg, ShmSlot &slot) {
+  slot.status = kShmStatusBadRequest;
+  slot.signatureSize = 0;
+  slot.sigAlg = TPM2_ALG_NULL;
+
+  // The client can still write to the slot, so read the size exactly once
+  // and only copy as much as was checked.
+  uint16_t digestSize =
+      std::atomic_ref<uint16_t>(slot.digestSize).load(std::memory_order_relaxed);
+  if (digestSize == SHA256_DIGEST_LENGTH) {
+    TPM2B_DIGEST digest{};
+    digest.size = SHA256_DIGEST_LENGTH;
+    std::memcpy(digest.buffer, slot.digest, SHA256_DIGEST_LENGTH);
+
+    TPMT_SIGNATURE *signature = nullptr;
+    slot.status = kShmStatusTPMError;
+    if (TPMSignDigest(esys, childHandle, sessionHandle, keyAlg, digest,
+                      &signature)) {
+      std::vector<unsigned char> sig = TPMSignatureBytes(*signature);
+      if (!sig.empty() && sig.size() <= kShmMaxSignature) {
+        std::memcpy(slot.signature, sig.data(), sig.size());
+        slot.signatureSize = static_cast<uint16_t>(sig.size());
+        slot.sigAlg = signature->sigAlg;
+        slot.status = kShmStatusOk;
+      }
+    }
+    Esys_Free(signature);
+  }
+
+  slot.state.store(kShmSlotDone, std::memory_order_seq_cst);
+  if (slot.waiting.load(std::memory_order_seq_cst))
+    ShmFutexWake(slot.state, 1);
+}
+
+/**
+ * Head slot that is held by a client and not ready to serve, noted the first
+ * time the server goes idle on it.
+ */
+struct Stall {
+  uint64_t seq = 0;   ///< Slot sequence number when the stall was noted
+  uint64_t since = 0; ///< ShmNowMs() when the stall was noted, or 0
+};
+
+/**
+ * Takes back the slot at @p head if it is held by a client that died or
+ * has held it for longer than kShmStallTimeoutMs.
+ *
+ * @return True if the request at @p head was abandoned and the server should
+ *         move past it.
+ */
+bool ReclaimStalled(ShmRingHeader &ring, uint64_t head, Stall &stall) {
+  ShmSlot &slot = ring.slot[head & (kShmRingSlots - 1)];
+  uint64_t seq = slot.seq.load(std::memory_order_acquire);
+  bool claimed =
+      seq == head && ring.tail.load(std::memory_order_relaxed) > head;
+  bool uncollected = seq == head - kShmRingSlots + 1;
+  if (!claimed && !uncollected) {
+    stall = {};
+    return false;
+  }
+
+  uint64_t now = ShmNowMs();
+  if (stall.since == 0 || stall.seq != seq)
+    stall = {seq, now};
+  // The owner is stored just after the claim, so a tag for another position
+  // only means "not yet".
+  uint64_t pos = claimed ? head : head - kShmRingSlots;
+  int32_t owner =
+      ShmOwnerPid(slot.owner.load(std::memory_order_relaxed), pos);
+  bool dead = owner != 0 && !ShmProcessAlive(owner);
+  if (!dead && now - stall.since < kShmStallTimeoutMs)
+    return false;
+  stall = {};
+
+  if (claimed) {
+    // Mark the position published without serving it; the client's
+    // publishing CAS fails and it releases the slot if it is still alive.
+    return slot.seq.compare_exchange_strong(seq, head + 1,
+                                            std::memory_order_acq_rel);
+  }
+  // Free a result nobody will collect so this lap can claim the slot.
+  slot.seq.compare_exchange_strong(seq, head, std::memory_order_release);
+  return false;
+}
+
+/**
+ * Marks the ring closed and fails every published request so that no client
+ * keeps waiting on a server that is going away.
+ */
+void CloseRing(ShmRingHeader &ring, uint64_t head) {
+  ring.closed.store(1, std::memory_order_seq_cst);
+  ring.magic.store(0, std::memory_order_seq_cst);
+
+  uint64_t tail = ring.tail.load(std::memory_order_seq_cst);
+  for (uint64_t pos = head; pos != tail; pos++) {
+    ShmSlot &slot = ring.slot[pos & (kShmRingSlots - 1)];
+    if (slot.seq.load(std::memory_order_acquire) != pos + 1)
+      continue;
+    slot.status = kShmStatusShutdown;
+    slot.signatureSize = 0;
+    slot.sigAlg = TPM2_ALG_NULL;
+    slot.state.store(kShmSlotDone, std::memory_order_seq_cst);
+    ShmFutexWake(slot.state, INT_MAX);
+  }
+}
+
+} // namespace
+
+bool CreateShmRing(const std::string &name, ShmRing &shm) {
+  // Servers serialize on NAME.lock, which is never unlinked, so at most one
+  // of them can replace the ring and the lock dies with its holder.
+  std::string lockName = name + ".lock";
+  shm.lockFd = shm_open(lockName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+  if (shm.lockFd < 0) {
+    fail("shm_open " + lockName + ": " + std::strerror(errno));
+    return false;
+  }
+  if (flock(shm.lockFd, LOCK_EX | LOCK_NB) != 0) {
+    if (errno == EWOULDBLOCK)
+      fail("shm " + name + ": already being served by another process");
+    else
+      fail("flock " + lockName + ": " + std::strerror(errno));
+    return false;
+  }
+  // Whatever is left is a ring of a dead server.
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660);
+  if (fd < 0) {
+    fail("shm_open " + name + ": " + std::strerror(errno));
+    return false;
+  }
+  if (ftruncate(fd, sizeof(ShmRingHeader)) != 0) {
+    fail("ftruncate " + name + ": " + std::strerror(errno));
+    close(fd);
+    shm_unlink(name.c_str());
+    return false;
+  }
+  void *addr = mmap(nullptr, sizeof(ShmRingHeader), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    fail("mmap " + name + ": " + std::strerror(errno));
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  shm.name = name;
+  shm.ring = new (addr) ShmRingHeader();
+  shm.ring->version = kShmRingVersion;
+  shm.ring->slots = kShmRingSlots;
+  shm.ring->serverPid = getpid();
+  for (uint32_t i = 0; i < kShmRingSlots; i++)
+    shm.ring->slot[i].seq.store(i, std::memory_order_relaxed);
+  // Publish last: clients refuse to attach until the magic is set.
+  shm.ring->magic.store(kShmRingMagic, std::memory_order_release);
+  return true;
+}
+
+bool TPMServeShm(Args &args, EsysCtx &esys, ESYS_TR &childHandle,
+                 ESYS_TR &sessionHandle) {
+  ShmRing shm;
+  if (!CreateShmRing(args.shmName, shm))
+    return false;
+  ok("Shared-memory ring created");
+  kv("Name", args.shmName);
+  kv("Slots", std::to_string(kShmRingSlots));
+  kv("Size", std::to_string(sizeof(ShmRingHeader)));
+  kv("note", "Serving until SIGINT/SIGTERM");
+
+  gStop = 0;
+  std::signal(SIGINT, OnStopSignal);
+  std::signal(SIGTERM, OnStopSignal);
+
+  ShmRingHeader &ring = *shm.ring;
+  const timespec timeout{0, 200 * 1000 * 1000};
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  uint64_t served = 0;
+  uint64_t abandoned = 0;
+  Stall stall;
+  int idle = 0;
+  while (!gStop) {
+    ShmSlot &slot = ring.slot[head & (kShmRingSlots - 1)];
+    if (slot.seq.load(std::memory_order_acquire) == head + 1) {
+      ServeSlot(esys, childHandle, sessionHandle, args.keyAlg, slot);
+      ring.head.store(++head, std::memory_order_relaxed);
+      served++;
+      stall = {};
+      idle = 0;
+      continue;
+    }
+
+    if (++idle < kShmServerSpin)
+      continue;
+
+    if (ReclaimStalled(ring, head, stall)) {
+      ring.head.store(++head, std::memory_order_relaxed);
+      abandoned++;
+      idle = 0;
+      continue;
+    }
+
+    // Announce the sleep before sampling the doorbell so a client that
+    // publishes after the sample is guaranteed to see the flag and wake us.
+    ring.serverSleeping.store(1, std::memory_order_seq_cst);
+    uint32_t bell = ring.doorbell.load(std::memory_order_seq_cst);
+    if (slot.seq.load(std::memory_order_acquire) != head + 1)
+      ShmFutexWait(ring.doorbell, bell, &timeout);
+    ring.serverSleeping.store(0, std::memory_order_relaxed);
+    idle = 0;
+  }
+
+  CloseRing(ring, head);
+  std::signal(SIGINT, SIG_DFL);
+  std::signal(SIGTERM, SIG_DFL);
+  std::println(stdout, "");
+  ok("Shared-memory server stopped");
+  kv("Requests Served", std::to_string(served));
+  kv("Requests Abandoned", std::to_string(abandoned));
+  return true;
+}
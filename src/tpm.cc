@@ -1,8 +1,15 @@
 #include "tpm.h"
 #include "tss2_tpm2_types.h"
 #include "ui.h"
+#include <cerrno>
 #include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <openssl/ecdsa.h>
 #include <print>
+#include <tss2/tss2_mu.h>
+#include <unistd.h>
 
 bool TPMStartAuth(Args &args, EsysCtx &esys, ESYS_TR &sessionHandle) {
   TPM2B_AUTH ownerAuth{};
@@ -141,39 +148,137 @@ bool ConnectTPM(Args &args, std::string tctiConf, TctiCtx &tcti,
   return true;
 }
 
-bool TPMCreateLoad(Args &args, EsysCtx &esys, ESYS_TR &primaryHandle,
-                   ESYS_TR sessionHandle, ESYS_TR &childHandle) {
+bool SaveKeyBlob(const std::string &path, const TPM2B_PUBLIC &pub,
+                 const TPM2B_PRIVATE &priv) {
+  uint8_t buf[sizeof(TPM2B_PUBLIC) + sizeof(TPM2B_PRIVATE)];
+  size_t len = 0;
+  if (!CheckRC(Tss2_MU_TPM2B_PUBLIC_Marshal(&pub, buf, sizeof(buf), &len),
+               "Marshal public") ||
+      !CheckRC(Tss2_MU_TPM2B_PRIVATE_Marshal(&priv, buf, sizeof(buf), &len),
+               "Marshal private"))
+    return false;
+
+  // Write to a temporary file and rename so a crash never leaves a torn blob.
+  std::string tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  bool saved = fd >= 0;
+  for (size_t off = 0; saved && off < len;) {
+    ssize_t n = write(fd, buf + off, len - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0)
+      errno = EIO;
+    saved = n > 0;
+    off += saved ? static_cast<size_t>(n) : 0;
+  }
+  saved = saved && fsync(fd) == 0 && rename(tmp.c_str(), path.c_str()) == 0;
+  int err = errno; // close() and unlink() below may overwrite it
+  if (fd >= 0)
+    close(fd);
+  if (!saved) {
+    unlink(tmp.c_str());
+    fail("Save key blob: " + path + ": " + std::strerror(err));
+    return false;
+  }
 
-  TPM2B_SENSITIVE_CREATE childSensitive{};
-  childSensitive.size = 0;
-  childSensitive.sensitive.userAuth.size = 0;
-  childSensitive.sensitive.data.size = 0;
-
-  TPM2B_PUBLIC childPublic = MakeRSASigningChildTemplate();
-  TPM2B_DATA childOutsideInfo{};
-  childOutsideInfo.size = 0;
-  TPML_PCR_SELECTION childCreationPCR{};
-  childCreationPCR.count = 0;
-
-  TPM2B_PRIVATE *outPrivate = nullptr;
-  TPM2B_PUBLIC *outChildPublic = nullptr;
-  TPM2B_CREATION_DATA *outCreationData = nullptr;
-  TPM2B_DIGEST *outCreationHash = nullptr;
-  TPMT_TK_CREATION *outCreationTicket = nullptr;
-
-  if (!CheckRC(Esys_Create(esys.ctx, primaryHandle, sessionHandle, ESYS_TR_NONE,
-                           ESYS_TR_NONE, &childSensitive, &childPublic,
-                           &childOutsideInfo, &childCreationPCR, &outPrivate,
-                           &outChildPublic, &outCreationData, &outCreationHash,
-                           &outCreationTicket),
-               "Create"))
+  // The journal that names this key is fsynced next; make sure the rename
+  // reaches the disk before it does.
+  std::string dir = std::filesystem::path(path).parent_path().string();
+  if (dir.empty())
+    dir = ".";
+  int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  bool synced = dirFd >= 0 && fsync(dirFd) == 0;
+  err = errno;
+  if (dirFd >= 0)
+    close(dirFd);
+  if (!synced) {
+    fail("Sync key blob directory: " + dir + ": " + std::strerror(err));
     return false;
+  }
+  return true;
+}
 
-  ok("TPM2_Create (child) Success");
+bool LoadKeyBlob(const std::string &path, TPM2B_PUBLIC &pub,
+                 TPM2B_PRIVATE &priv) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    fail("Load key blob: " + path);
+    return false;
+  }
+  std::vector<uint8_t> buf((std::istreambuf_iterator<char>(in)),
+                           std::istreambuf_iterator<char>());
+
+  size_t off = 0;
+  return CheckRC(Tss2_MU_TPM2B_PUBLIC_Unmarshal(buf.data(), buf.size(), &off,
+                                                &pub),
+                 "Unmarshal public") &&
+         CheckRC(Tss2_MU_TPM2B_PRIVATE_Unmarshal(buf.data(), buf.size(), &off,
+                                                 &priv),
+                 "Unmarshal private");
+}
 
+bool TPMCreateLoad(Args &args, EsysCtx &esys, ESYS_TR &primaryHandle,
+                   ESYS_TR sessionHandle, ESYS_TR &childHandle) {
+  TPM2B_PRIVATE childPrivate{};
+  TPM2B_PUBLIC childLoaded{};
   childHandle = ESYS_TR_NONE;
+
+  if (!args.childKeyPath.empty() &&
+      std::filesystem::exists(args.childKeyPath)) {
+    if (!LoadKeyBlob(args.childKeyPath, childLoaded, childPrivate))
+      return false;
+    ok("Child key blob loaded");
+    kv("Key Blob", args.childKeyPath);
+  } else {
+    TPM2B_SENSITIVE_CREATE childSensitive{};
+    childSensitive.size = 0;
+    childSensitive.sensitive.userAuth.size = 0;
+    childSensitive.sensitive.data.size = 0;
+
+    TPM2B_PUBLIC childPublic = MakeSigningChildTemplate(args.keyAlg);
+    TPM2B_DATA childOutsideInfo{};
+    childOutsideInfo.size = 0;
+    TPML_PCR_SELECTION childCreationPCR{};
+    childCreationPCR.count = 0;
+
+    TPM2B_PRIVATE *outPrivate = nullptr;
+    TPM2B_PUBLIC *outChildPublic = nullptr;
+    TPM2B_CREATION_DATA *outCreationData = nullptr;
+    TPM2B_DIGEST *outCreationHash = nullptr;
+    TPMT_TK_CREATION *outCreationTicket = nullptr;
+
+    if (!CheckRC(Esys_Create(esys.ctx, primaryHandle, sessionHandle,
+                             ESYS_TR_NONE, ESYS_TR_NONE, &childSensitive,
+                             &childPublic, &childOutsideInfo,
+                             &childCreationPCR, &outPrivate, &outChildPublic,
+                             &outCreationData, &outCreationHash,
+                             &outCreationTicket),
+                 "Create"))
+      return false;
+
+    ok("TPM2_Create (child) Success");
+
+    childPrivate = *outPrivate;
+    childLoaded = *outChildPublic;
+
+    // Free create outputs now that they are copied
+    Esys_Free(outPrivate);
+    Esys_Free(outChildPublic);
+    Esys_Free(outCreationData);
+    Esys_Free(outCreationHash);
+    Esys_Free(outCreationTicket);
+
+    if (!args.childKeyPath.empty()) {
+      if (!SaveKeyBlob(args.childKeyPath, childLoaded, childPrivate))
+        return false;
+      ok("Child key blob saved");
+      kv("Key Blob", args.childKeyPath);
+    }
+  }
+
+  args.keyAlg = childLoaded.publicArea.type;
   if (!CheckRC(Esys_Load(esys.ctx, primaryHandle, sessionHandle, ESYS_TR_NONE,
-                         ESYS_TR_NONE, outPrivate, outChildPublic,
+                         ESYS_TR_NONE, &childPrivate, &childLoaded,
                          &childHandle),
                "Load"))
     return false;
@@ -185,23 +290,58 @@ bool TPMCreateLoad(Args &args, EsysCtx &esys, ESYS_TR &primaryHandle,
     kv("Child Handle: ", ch.str());
   }
 
-  if (outChildPublic) {
-    kv("child type", TPMAlgToString(outChildPublic->publicArea.type));
-    kv("child nameAlg", TPMAlgToString(outChildPublic->publicArea.nameAlg));
-    kv("child attributes",
-       TPMAObjectToString(outChildPublic->publicArea.objectAttributes));
-  }
-
-  // Free create outputs now that loaded
-  Esys_Free(outPrivate);
-  Esys_Free(outChildPublic);
-  Esys_Free(outCreationData);
-  Esys_Free(outCreationHash);
-  Esys_Free(outCreationTicket);
+  kv("child type", TPMAlgToString(childLoaded.publicArea.type));
+  kv("child nameAlg", TPMAlgToString(childLoaded.publicArea.nameAlg));
+  kv("child attributes",
+     TPMAObjectToString(childLoaded.publicArea.objectAttributes));
 
   return true;
 }
 
+bool TPMSignDigest(EsysCtx &esys, ESYS_TR childHandle, ESYS_TR sessionHandle,
+                   TPM2_ALG_ID keyAlg, const TPM2B_DIGEST &digest,
+                   TPMT_SIGNATURE **signature) {
+  TPMT_SIG_SCHEME scheme = MakeSigningScheme(keyAlg);
+
+  TPMT_TK_HASHCHECK validation{};
+  validation.tag = TPM2_ST_HASHCHECK;
+  validation.hierarchy = TPM2_RH_NULL;
+  validation.digest.size = 0;
+
+  *signature = nullptr;
+  return CheckRC(Esys_Sign(esys.ctx, childHandle, sessionHandle, ESYS_TR_NONE,
+                           ESYS_TR_NONE, &digest, &scheme, &validation,
+                           signature),
+                 "Sign");
+}
+
+std::vector<unsigned char> TPMSignatureBytes(const TPMT_SIGNATURE &signature) {
+  if (signature.sigAlg == TPM2_ALG_RSASSA) {
+    const TPM2B_PUBLIC_KEY_RSA &sig = signature.signature.rsassa.sig;
+    return std::vector<unsigned char>(sig.buffer, sig.buffer + sig.size);
+  }
+  if (signature.sigAlg == TPM2_ALG_ECDSA) {
+    const TPMS_SIGNATURE_ECC &ecc = signature.signature.ecdsa;
+    ECDSA_SIG *sig = ECDSA_SIG_new();
+    BIGNUM *r = BN_bin2bn(ecc.signatureR.buffer, ecc.signatureR.size, nullptr);
+    BIGNUM *s = BN_bin2bn(ecc.signatureS.buffer, ecc.signatureS.size, nullptr);
+    std::vector<unsigned char> der;
+    if (sig && r && s && ECDSA_SIG_set0(sig, r, s)) {
+      r = s = nullptr; // owned by sig
+      unsigned char *p = nullptr;
+      int len = i2d_ECDSA_SIG(sig, &p);
+      if (len > 0)
+        der.assign(p, p + len);
+      OPENSSL_free(p);
+    }
+    BN_free(r);
+    BN_free(s);
+    ECDSA_SIG_free(sig);
+    return der;
+  }
+  return {};
+}
+
 bool TPMSignMessage(Args &args, EsysCtx &esys, ESYS_TR &childHandle,
                     ESYS_TR &sessionHandle) {
   TPM2B_DIGEST digest = SHA256ToTPMDigest(args.message);
@@ -210,30 +350,19 @@ bool TPMSignMessage(Args &args, EsysCtx &esys, ESYS_TR &childHandle,
   std::println(stdout, "{}Digest:{}", CYAN, RESET);
   PrintHex(digest.buffer, digest.size);
 
-  TPMT_SIG_SCHEME scheme{};
-  scheme.scheme = TPM2_ALG_RSASSA;
-  scheme.details.rsassa.hashAlg = TPM2_ALG_SHA256;
-
-  TPMT_TK_HASHCHECK validation{};
-  validation.tag = TPM2_ST_HASHCHECK;
-  validation.hierarchy = TPM2_RH_NULL;
-  validation.digest.size = 0;
-
   TPMT_SIGNATURE *signature = nullptr;
-  if (!CheckRC(Esys_Sign(esys.ctx, childHandle, sessionHandle, ESYS_TR_NONE,
-                         ESYS_TR_NONE, &digest, &scheme, &validation,
-                         &signature),
-               "Sign"))
+  if (!TPMSignDigest(esys, childHandle, sessionHandle, args.keyAlg, digest,
+                     &signature))
     return false;
   ok("TPM2_Sign Success");
 
   if (signature) {
     kv("Signature Algorithm: ", TPMAlgToString(signature->sigAlg));
-    if (signature->sigAlg == TPM2_ALG_RSASSA) {
-      const TPM2B_PUBLIC_KEY_RSA &sig = signature->signature.rsassa.sig;
-      kv("Signature Size", std::to_string(sig.size));
+    std::vector<unsigned char> sig = TPMSignatureBytes(*signature);
+    if (!sig.empty()) {
+      kv("Signature Size", std::to_string(sig.size()));
       std::println(stdout, "{}Signature:{}", CYAN, RESET);
-      PrintHex(sig.buffer, sig.size);
+      PrintHex(sig.data(), sig.size());
     } else {
       warn("Signature print not implemented");
     }
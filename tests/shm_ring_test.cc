@@ -0,0 +1,281 @@
+/**
+ * Stress and failure tests for the shared-memory signing ring.
+ *
+ * The server side runs the real TPMServeShm loop in a forked process with a
+ * stub signer in place of TPM2_Sign, so no TPM is needed. The stub "signs"
+ * by inverting the digest, which lets clients check that every answer
+ * belongs to their own request.
+ */
+#include "shm_client.h"
+#include "shm_server.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/wait.h>
+#include <vector>
+
+namespace {
+
+/// First digest byte that makes the stub signer take this long.
+constexpr unsigned char kSlowDigest = 0xee;
+constexpr useconds_t kSlowSignUs = 300 * 1000;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__,    \
+                   #cond);                                                     \
+      std::exit(1);                                                            \
+    }                                                                          \
+  } while (0)
+
+uint64_t ElapsedMs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+/**
+ * Signs one digest filled with @p fill and checks the stub signature.
+ */
+bool SignOne(ShmSignClient &client, unsigned char fill) {
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  std::memset(digest, fill, sizeof(digest));
+  std::vector<unsigned char> signature;
+  if (!ShmSign(client, digest, sizeof(digest), signature))
+    return false;
+  CHECK(signature.size() == sizeof(digest));
+  for (unsigned char b : signature)
+    CHECK(b == static_cast<unsigned char>(~fill));
+  return true;
+}
+
+/**
+ * Claims the next position by hand, as a client that stops right after the
+ * CAS on tail would.
+ */
+uint64_t ClaimOnly(ShmSignClient &client) {
+  uint64_t pos = client.ring->tail.fetch_add(1);
+  ShmSlot &slot = client.ring->slot[pos & (kShmRingSlots - 1)];
+  slot.owner.store(ShmOwnerTag(pos, getpid()));
+  return pos;
+}
+
+/**
+ * Claims and publishes a request by hand and waits for the server to answer
+ * it, without releasing the slot.
+ */
+uint64_t PublishAndWait(ShmSignClient &client, unsigned char fill) {
+  uint64_t pos = ClaimOnly(client);
+  ShmSlot &slot = client.ring->slot[pos & (kShmRingSlots - 1)];
+  std::memset(slot.digest, fill, SHA256_DIGEST_LENGTH);
+  slot.digestSize = SHA256_DIGEST_LENGTH;
+  slot.state.store(kShmSlotPending);
+  slot.seq.store(pos + 1);
+  client.ring->doorbell.fetch_add(1);
+  ShmFutexWake(client.ring->doorbell, 1);
+  while (slot.state.load() != kShmSlotDone)
+    sched_yield();
+  return pos;
+}
+
+pid_t StartServer(const std::string &name) {
+  pid_t pid = fork();
+  CHECK(pid >= 0);
+  if (pid == 0) {
+    Args args;
+    args.autoMode = true;
+    args.shmName = name;
+    EsysCtx esys;
+    ESYS_TR childHandle = ESYS_TR_NONE;
+    ESYS_TR sessionHandle = ESYS_TR_NONE;
+    _exit(TPMServeShm(args, esys, childHandle, sessionHandle) ? 0 : 1);
+  }
+  // Wait until the ring is published.
+  for (int i = 0; i < 500; i++) {
+    ShmSignClient probe;
+    if (ShmSignConnect(name.c_str(), probe))
+      return pid;
+    usleep(10 * 1000);
+  }
+  CHECK(!"server did not publish the ring");
+  return -1;
+}
+
+void TestShortObject(const std::string &name) {
+  std::string shortName = name + "-short";
+  shm_unlink(shortName.c_str());
+  int fd = shm_open(shortName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  CHECK(fd >= 0);
+  close(fd);
+  ShmSignClient client;
+  CHECK(!ShmSignConnect(shortName.c_str(), client));
+  shm_unlink(shortName.c_str());
+  std::puts("ok: zero-length object is not mapped");
+}
+
+void TestSecondServer(const std::string &name) {
+  ShmRing other;
+  CHECK(!CreateShmRing(name, other));
+  std::puts("ok: second server refused");
+}
+
+void TestStress(const std::string &name) {
+  constexpr int kClients = 4;
+  constexpr int kRequests = 5000;
+  auto start = std::chrono::steady_clock::now();
+  for (int c = 0; c < kClients; c++) {
+    if (fork() != 0)
+      continue;
+    ShmSignClient client;
+    if (!ShmSignConnect(name.c_str(), client))
+      _exit(2);
+    for (int i = 0; i < kRequests; i++)
+      if (!SignOne(client, static_cast<unsigned char>(c * 31 + i) & 0x7f))
+        _exit(3);
+    _exit(0);
+  }
+  for (int c = 0; c < kClients; c++) {
+    int status = 0;
+    wait(&status);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  std::printf("ok: %d requests from %d clients in %llu ms\n",
+              kClients * kRequests, kClients,
+              static_cast<unsigned long long>(ElapsedMs(start)));
+}
+
+void TestDeadClaimant(const std::string &name, ShmSignClient &client) {
+  if (fork() == 0) {
+    ShmSignClient dying;
+    ShmSignConnect(name.c_str(), dying);
+    ClaimOnly(dying);
+    _exit(0);
+  }
+  wait(nullptr);
+  auto start = std::chrono::steady_clock::now();
+  CHECK(SignOne(client, 1));
+  CHECK(ElapsedMs(start) < kShmStallTimeoutMs);
+  std::puts("ok: claim of a dead client skipped");
+}
+
+void TestDeadHolder(const std::string &name, ShmSignClient &client) {
+  if (fork() == 0) {
+    ShmSignClient dying;
+    ShmSignConnect(name.c_str(), dying);
+    PublishAndWait(dying, 2);
+    _exit(0);
+  }
+  wait(nullptr);
+  // Lap the ring so the server reaches the uncollected slot again.
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < 2 * kShmRingSlots; i++)
+    CHECK(SignOne(client, 3));
+  CHECK(ElapsedMs(start) < kShmStallTimeoutMs);
+  std::puts("ok: result of a dead client released on the next lap");
+}
+
+void TestSlowCollector(ShmSignClient &client) {
+  uint64_t pos = PublishAndWait(client, 4);
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < 2 * kShmRingSlots; i++)
+    CHECK(SignOne(client, 5));
+  CHECK(ElapsedMs(start) >= kShmStallTimeoutMs);
+  // The server took the slot back, so collecting it now must fail.
+  CHECK(!ShmReleaseSlot(client.ring->slot[pos & (kShmRingSlots - 1)], pos));
+  std::puts("ok: result of a slow live client released after the timeout");
+}
+
+void TestStuckClaimant(ShmSignClient &client) {
+  uint64_t pos = ClaimOnly(client);
+  auto start = std::chrono::steady_clock::now();
+  CHECK(SignOne(client, 6));
+  CHECK(ElapsedMs(start) >= kShmStallTimeoutMs);
+  // Publishing late must fail, and the slot is ours to release.
+  ShmSlot &slot = client.ring->slot[pos & (kShmRingSlots - 1)];
+  uint64_t claimed = pos;
+  CHECK(!slot.seq.compare_exchange_strong(claimed, pos + 1));
+  CHECK(ShmReleaseSlot(slot, pos));
+  CHECK(SignOne(client, 7));
+  std::puts("ok: claim of a stuck live client skipped after the timeout");
+}
+
+void TestShutdown(const std::string &name, pid_t server,
+                  ShmSignClient &client) {
+  constexpr int kClients = 4;
+  for (int c = 0; c < kClients; c++) {
+    if (fork() != 0)
+      continue;
+    ShmSignClient waiter;
+    if (!ShmSignConnect(name.c_str(), waiter))
+      _exit(2);
+    _exit(SignOne(waiter, kSlowDigest) ? 1 : 0);
+  }
+  usleep(100 * 1000);
+
+  auto start = std::chrono::steady_clock::now();
+  CHECK(kill(server, SIGINT) == 0);
+  int status = 0;
+  CHECK(waitpid(server, &status, 0) == server);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  int failed = 0;
+  for (int c = 0; c < kClients; c++) {
+    CHECK(wait(&status) > 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) <= 1);
+    failed += WEXITSTATUS(status) == 0;
+  }
+  // The stub signs one slow request at a time, so most are still pending.
+  CHECK(failed > 0);
+  CHECK(ElapsedMs(start) < kShmStallTimeoutMs);
+  CHECK(client.ring->closed.load() == 1);
+  CHECK(client.ring->magic.load() == 0);
+  CHECK(!SignOne(client, 8));
+  ShmSignClient late;
+  CHECK(!ShmSignConnect(name.c_str(), late));
+  std::printf("ok: shutdown failed %d pending requests\n", failed);
+}
+
+} // namespace
+
+bool TPMSignDigest(EsysCtx &, ESYS_TR, ESYS_TR, TPM2_ALG_ID,
+                   const TPM2B_DIGEST &digest, TPMT_SIGNATURE **signature) {
+  if (digest.buffer[0] == kSlowDigest)
+    usleep(kSlowSignUs);
+  // ServeSlot releases the result with Esys_Free, i.e. free().
+  *signature =
+      static_cast<TPMT_SIGNATURE *>(std::calloc(1, sizeof(TPMT_SIGNATURE)));
+  TPM2B_PUBLIC_KEY_RSA &sig = (*signature)->signature.rsassa.sig;
+  (*signature)->sigAlg = TPM2_ALG_RSASSA;
+  sig.size = digest.size;
+  for (uint16_t i = 0; i < digest.size; i++)
+    sig.buffer[i] = ~digest.buffer[i];
+  return true;
+}
+
+std::vector<unsigned char> TPMSignatureBytes(const TPMT_SIGNATURE &signature) {
+  const TPM2B_PUBLIC_KEY_RSA &sig = signature.signature.rsassa.sig;
+  return {sig.buffer, sig.buffer + sig.size};
+}
+
+int main() {
+  std::string name = "/tpm-sign-test-" + std::to_string(getpid());
+
+  TestShortObject(name);
+  pid_t server = StartServer(name);
+  TestSecondServer(name);
+  TestStress(name);
+
+  ShmSignClient client;
+  CHECK(ShmSignConnect(name.c_str(), client));
+  TestDeadClaimant(name, client);
+  TestDeadHolder(name, client);
+  TestSlowCollector(client);
+  TestStuckClaimant(client);
+  TestShutdown(name, server, client);
+
+  shm_unlink((name + ".lock").c_str());
+  std::puts("PASS");
+  return 0;
+}